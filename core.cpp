@@ -1,72 +1,788 @@
+#include <limits.h>
 #include <math.h>
+#include <algorithm>
+#include <chrono>
 
 #include "value.hpp"
+#include "simd.hpp"
 
 #define RETURN(val) vm->push(val)
 #define RETURN_NUM(val) vm->push(newNum(val))
+#define RETURN_INT(val) vm->push(newInt(val))
 #define RETURN_STRING(val) vm->push(newString(vm, val))
 
-void initCore(VM &vm) {
-    AS(vm.memory[0], Function)->foreign = true;
-    vm.functions[AS(vm.memory[0], Function)] = [](VM *vm, Value *args) {
-        printf("%s\n", valueToStr(vm, args[1]).c_str());
-    };
-
-    vm.numClass->symbols[vm.compiler->findSymbol("<")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num < args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol(">")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num > args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("<=")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num <= args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol(">=")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num >= args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("==")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num == args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("!=")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num != args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("+")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num + args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("-")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num - args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("*")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num * args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("/")] = [](VM *vm, Value *args) {
-        RETURN_NUM(args[0].as.num / args[1].as.num);
-    };
-    vm.numClass->symbols[vm.compiler->findSymbol("sin")] = [](VM *vm, Value *args) {
-        RETURN_NUM(sin(args[0].as.num));
-    };
-
-    vm.strClass->symbols[vm.compiler->findSymbol("+")] = [](VM *vm, Value *args) {
-        RETURN_STRING(AS(args[0], String)->value + AS(args[1], String)->value);
-    };
-
-    vm.listClass->symbols[vm.compiler->findSymbol("size")] = [](VM *vm, Value *args) {
-        RETURN_NUM(AS(args[0], List)->size);
-    };
-
-    vm.listClass->symbols[vm.compiler->findSymbol("add")] = [](VM *vm, Value *args) {
-        AS(args[0], List)->add(args[1]);
-    };
-    vm.listClass->symbols[vm.compiler->findSymbol("get")] = [](VM *vm, Value *args) {
+// In CoreSymbol order.
+const char *const coreSymbolNames[CORE_SYMBOLS] = {
+    "<", ">", "<=", ">=", "==", "!=", "+", "-", "*", "/", "sin",
+    "size", "add", "get", "set", "addAll", "insert", "remove", "clear", "slice",
+    "reserve", "shrink", "capacity",
+    "sum", "min", "max", "dot", "scale", "fill",
+    "parallelMap", "parallelReduce", "alive",
+    "map", "filter", "take", "reduce", "toList",
+    "lines", "chunks", "contains", "toString",
+    "keys", "values", "parse", "stringify",
+    "sort", "binarySearch", "indexOf",
+};
+
+const uint8_t coreSymbolArgs[CORE_SYMBOLS][2] = {
+    {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {1, 1}, {0, 0},
+    {0, 0}, {1, 1}, {1, 1}, {2, 2}, {1, 1}, {2, 2}, {1, 1}, {0, 0}, {2, 2},
+    {1, 1}, {0, 0}, {0, 0},
+    {0, 0}, {0, 0}, {0, 0}, {1, 1}, {1, 1}, {1, 1},
+    {1, 1}, {2, 2}, {0, 0},
+    {1, 1}, {1, 1}, {1, 1}, {2, 2}, {0, 0},
+    {0, 0}, {1, 1}, {1, 1}, {0, 0},
+    {0, 0}, {0, 0}, {1, 1}, {1, 1},
+    {0, 1}, {1, 2}, {1, 1},
+};
+
+struct NativeMethod {
+    int symbol;
+    // No side effects, so loops may hoist it when invariant.
+    bool pure;
+    Native fn;
+};
+
+struct CoreGlobal {
+    const char *name;
+    int arity;
+    Native fn;
+};
+
+static Float64Array *toFloat64Array(VM *vm, Value v) {
+    if (!v.isObject || v.as.object->classObject != vm->float64ArrayClass)
+        abort("float64Array expected.");
+
+    return AS(v, Float64Array);
+}
+
+static List *toList(VM *vm, Value v) {
+    if (!v.isObject || v.as.object->classObject != vm->listClass)
+        abort("List expected.");
+
+    return AS(v, List);
+}
+
+static Value sequenceValue(Sequence *sequence) {
+    Value value;
+    value.isObject = true;
+    value.isInt = false;
+    value.as.object = sequence;
+    return value;
+}
+
+static Sequence *listSequence(VM *vm, Value list) {
+    Sequence *sequence = new Sequence(vm);
+    sequence->list = list;
+    return sequence;
+}
+
+static Value objectValue(Object *object) {
+    Value value;
+    value.isObject = true;
+    value.isInt = false;
+    value.as.object = object;
+    return value;
+}
+
+// Where the characters of a String or a view are, without copying them;
+// anything else is an error.
+static void bytes(VM *vm, Value v, const char **data, int64_t *size) {
+    if (v.isObject && v.as.object->classObject == vm->strClass) {
+        *data = AS(v, String)->value.data();
+        *size = AS(v, String)->value.size();
+    } else if (v.isObject && v.as.object->classObject == vm->stringViewClass) {
+        *data = AS(v, StringView)->data;
+        *size = AS(v, StringView)->size;
+    } else {
+        abort("String expected.");
+    }
+}
+
+static std::string text(VM *vm, Value v) {
+    const char *data;
+    int64_t size;
+    bytes(vm, v, &data, &size);
+    return std::string(data, size);
+}
+
+static bool contains(VM *vm, Value haystack, Value needle) {
+    const char *data, *part;
+    int64_t size, partSize;
+    bytes(vm, haystack, &data, &size);
+    bytes(vm, needle, &part, &partSize);
+
+    return std::search(data, data + size, part, part + partSize) != data + size || partSize == 0;
+}
+
+// The order list.sort uses without a comparator: numbers by value with NaN
+// last, strings by their bytes.
+static int compareNative(VM *vm, Value a, Value b) {
+    if (!a.isObject && !b.isObject) {
+        if (a.isInt && b.isInt)
+            return (a.as.integer > b.as.integer) - (a.as.integer < b.as.integer);
+
+        double x = asNum(a);
+        double y = asNum(b);
+
+        if (isnan(x) || isnan(y))
+            return isnan(x) - isnan(y);
+
+        return (x > y) - (x < y);
+    }
+
+    if (a.isObject && b.isObject &&
+        a.as.object->classObject == vm->strClass && b.as.object->classObject == vm->strClass)
+        return AS(a, String)->value.compare(AS(b, String)->value);
+
+    abort("Only numbers or strings compare without a comparator.");
+    return 0;
+}
+
+static Sequence *fileSequence(VM *vm, Value file, int64_t chunk) {
+    Sequence *sequence = new Sequence(vm);
+    sequence->file = AS(file, File);
+    sequence->chunk = chunk;
+    return sequence;
+}
+
+static Sequence::Stage stage(Sequence::Stage::Kind kind, Value fn, int64_t count = 0) {
+    Sequence::Stage stage;
+    stage.kind = kind;
+    stage.fn = fn;
+    stage.count = count;
+    return stage;
+}
+
+// Natives bound to the core globals, in slot order.
+static const CoreGlobal coreGlobals[] = {
+    {"print", 1, [](VM *vm, Value *args) {
+        writeValue(vm, vm->output.buffer, args[1]);
+        vm->output.buffer += '\n';
+        vm->output.flushIfFull();
+    }},
+    {"float64Array", 1, [](VM *vm, Value *args) {
+        if (args[1].isObject && args[1].as.object->classObject == vm->listClass) {
+            List *list = AS(args[1], List);
+            Value array = newFloat64Array(vm, list->size);
+
+            for (int i = 0; i < list->size; i++)
+                AS(array, Float64Array)->items[i] = asNum(list->items[i]);
+
+            RETURN(array);
+        } else {
+            RETURN(newFloat64Array(vm, asInt(args[1])));
+        }
+    }},
+    {"clock", 0, [](VM *vm, Value *args) {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        RETURN_NUM(std::chrono::duration<double>(now).count());
+    }},
+    {"coroutine", 1, [](VM *vm, Value *args) {
+        Value callee = args[1];
+
+        if (!callee.isObject ||
+            (callee.as.object->classObject != vm->functionClass &&
+             callee.as.object->classObject != vm->closureClass))
+            abort("Function expected.");
+
+        Function *fn = callee.as.object->classObject == vm->closureClass
+            ? AS(callee, Closure)->function : AS(callee, Function);
+
+        if (fn->foreign || fn->arity != 0)
+            abort("Coroutine needs a script function without arguments.");
+
+        Value value;
+        value.isObject = true;
+        value.isInt = false;
+        value.as.object = new Coroutine(vm, callee);
+        RETURN(value);
+    }},
+    {"range", 2, [](VM *vm, Value *args) {
+        Sequence *sequence = new Sequence(vm);
+        sequence->start = asInt(args[1]);
+        sequence->end = asInt(args[2]);
+        RETURN(sequenceValue(sequence));
+    }},
+    {"map", 0, [](VM *vm, Value *args) {
+        RETURN(newMap(vm));
+    }},
+    {"flush", 0, [](VM *vm, Value *args) {
+        vm->output.flush();
+    }},
+    {"snapshot", 1, [](VM *vm, Value *args) {
+        vm->snapshot(text(vm, args[1]));
+    }},
+    {"open", 1, [](VM *vm, Value *args) {
+        RETURN(objectValue(openFile(vm, text(vm, args[1]))));
+    }},
+};
+
+static const NativeMethod numMethods[] = {
+    {SYMBOL_LT, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer < args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) < asNum(args[1]));
+    }},
+    {SYMBOL_GT, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer > args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) > asNum(args[1]));
+    }},
+    {SYMBOL_LTEQ, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer <= args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) <= asNum(args[1]));
+    }},
+    {SYMBOL_GTEQ, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer >= args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) >= asNum(args[1]));
+    }},
+    {SYMBOL_EQ, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer == args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) == asNum(args[1]));
+    }},
+    {SYMBOL_NEQ, true, [](VM *vm, Value *args) {
+        if (args[0].isInt && args[1].isInt)
+            RETURN_INT(args[0].as.integer != args[1].as.integer);
+        else
+            RETURN_INT(asNum(args[0]) != asNum(args[1]));
+    }},
+    {SYMBOL_PLUS, true, [](VM *vm, Value *args) {
+        RETURN(numAdd(args[0], args[1]));
+    }},
+    {SYMBOL_MINUS, true, [](VM *vm, Value *args) {
+        RETURN(numSub(args[0], args[1]));
+    }},
+    {SYMBOL_TIMES, true, [](VM *vm, Value *args) {
+        RETURN(numMul(args[0], args[1]));
+    }},
+    {SYMBOL_DIVIDE, true, [](VM *vm, Value *args) {
+        RETURN(numDiv(args[0], args[1]));
+    }},
+    {SYMBOL_SIN, true, [](VM *vm, Value *args) {
+        RETURN_NUM(sin(asNum(args[0])));
+    }},
+};
+
+static const NativeMethod strMethods[] = {
+    {SYMBOL_PLUS, true, [](VM *vm, Value *args) {
+        RETURN_STRING(AS(args[0], String)->value + text(vm, args[1]));
+    }},
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], String)->value.size());
+    }},
+    {SYMBOL_CONTAINS, true, [](VM *vm, Value *args) {
+        RETURN_INT(contains(vm, args[0], args[1]));
+    }},
+    {SYMBOL_TO_STRING, true, [](VM *vm, Value *args) {
+        RETURN(args[0]);
+    }},
+};
+
+// Views answer the same methods as strings, reading the mapped bytes in
+// place; only + and toString copy them.
+static const NativeMethod stringViewMethods[] = {
+    {SYMBOL_PLUS, true, [](VM *vm, Value *args) {
+        StringView *view = AS(args[0], StringView);
+        RETURN_STRING(std::string(view->data, view->size) + text(vm, args[1]));
+    }},
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], StringView)->size);
+    }},
+    {SYMBOL_CONTAINS, true, [](VM *vm, Value *args) {
+        RETURN_INT(contains(vm, args[0], args[1]));
+    }},
+    {SYMBOL_TO_STRING, true, [](VM *vm, Value *args) {
+        RETURN(retain(vm, args[0]));
+    }},
+};
+
+static const NativeMethod mapMethods[] = {
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], Map)->entries.size());
+    }},
+    {SYMBOL_GET, true, [](VM *vm, Value *args) {
+        Value *value = AS(args[0], Map)->get(vm, args[1]);
+        if (value == nullptr)
+            abort("Key not found.");
+
+        RETURN(*value);
+    }},
+    {SYMBOL_SET, false, [](VM *vm, Value *args) {
+        AS(args[0], Map)->set(vm, args[1], args[2]);
+    }},
+    {SYMBOL_CONTAINS, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], Map)->get(vm, args[1]) != nullptr);
+    }},
+    {SYMBOL_REMOVE, false, [](VM *vm, Value *args) {
+        Value removed;
+        if (!AS(args[0], Map)->remove(vm, args[1], &removed))
+            abort("Key not found.");
+
+        RETURN(removed);
+    }},
+    {SYMBOL_KEYS, false, [](VM *vm, Value *args) {
+        Map *map = AS(args[0], Map);
+        Value keys = newList(vm);
+        AS(keys, List)->reserve(map->entries.size());
+
+        for (auto &entry : map->entries)
+            AS(keys, List)->add(objectValue(entry.key));
+
+        RETURN(keys);
+    }},
+    {SYMBOL_VALUES, false, [](VM *vm, Value *args) {
+        Map *map = AS(args[0], Map);
+        Value values = newList(vm);
+        AS(values, List)->reserve(map->entries.size());
+
+        for (auto &entry : map->entries)
+            AS(values, List)->add(entry.value);
+
+        RETURN(values);
+    }},
+};
+
+// Methods of the json global.
+static const NativeMethod jsonMethods[] = {
+    {SYMBOL_PARSE, false, [](VM *vm, Value *args) {
+        const char *data;
+        int64_t size;
+
+        // A mapped file is parsed in place.
+        if (args[1].isObject && args[1].as.object->classObject == vm->fileClass) {
+            data = AS(args[1], File)->data;
+            size = AS(args[1], File)->size;
+        } else {
+            bytes(vm, args[1], &data, &size);
+        }
+
+        RETURN(parseJson(vm, data, size));
+    }},
+    {SYMBOL_STRINGIFY, false, [](VM *vm, Value *args) {
+        std::string out;
+        writeJson(vm, out, args[1]);
+        RETURN_STRING(std::move(out));
+    }},
+};
+
+static const NativeMethod fileMethods[] = {
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], File)->size);
+    }},
+    {SYMBOL_LINES, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(fileSequence(vm, args[0], 0)));
+    }},
+    {SYMBOL_CHUNKS, false, [](VM *vm, Value *args) {
+        int64_t size = asInt(args[1]);
+        if (size <= 0)
+            abort("Chunk size must be positive.");
+
+        RETURN(sequenceValue(fileSequence(vm, args[0], size)));
+    }},
+};
+
+static const NativeMethod listMethods[] = {
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], List)->size);
+    }},
+    {SYMBOL_ADD, false, [](VM *vm, Value *args) {
+        AS(args[0], List)->add(retain(vm, args[1]));
+    }},
+    {SYMBOL_GET, true, [](VM *vm, Value *args) {
+        List *list = AS(args[0], List);
+        RETURN(list->items[toIndex(args[1], list->size)]);
+    }},
+    {SYMBOL_SET, false, [](VM *vm, Value *args) {
         List *list = AS(args[0], List);
-        int index = args[1].as.num;
+        list->items[toIndex(args[1], list->size)] = retain(vm, args[2]);
+    }},
+    {SYMBOL_ADD_ALL, false, [](VM *vm, Value *args) {
+        List *other = toList(vm, args[1]);
+        AS(args[0], List)->addAll(other->items, other->size);
+    }},
+    {SYMBOL_INSERT, false, [](VM *vm, Value *args) {
+        List *list = AS(args[0], List);
+        int64_t index = toInteger(args[1]);
 
         if (index < 0)
-            index = list->size + index;
+            index = list->size + index + 1;
+
+        if (index < 0 || index > list->size)
+            abort("Index out of bounds.");
+
+        list->insert(index, retain(vm, args[2]));
+    }},
+    {SYMBOL_REMOVE, false, [](VM *vm, Value *args) {
+        List *list = AS(args[0], List);
+        RETURN(list->remove(toIndex(args[1], list->size)));
+    }},
+    {SYMBOL_CLEAR, false, [](VM *vm, Value *args) {
+        AS(args[0], List)->clear();
+    }},
+    {SYMBOL_SLICE, false, [](VM *vm, Value *args) {
+        List *list = AS(args[0], List);
+        int64_t start = toInteger(args[1]);
+        int64_t end = toInteger(args[2]);
+
+        if (start < 0)
+            start = list->size + start;
+        if (end < 0)
+            end = list->size + end;
+
+        if (start < 0 || end > list->size || start > end)
+            abort("Index out of bounds.");
+
+        Value slice = newList(vm);
+        AS(slice, List)->addAll(list->items + start, end - start);
+
+        RETURN(slice);
+    }},
+    {SYMBOL_RESERVE, false, [](VM *vm, Value *args) {
+        int64_t count = toInteger(args[1]);
+        if (count > INT_MAX)
+            abort("Capacity is too large.");
+
+        AS(args[0], List)->reserve(count);
+    }},
+    {SYMBOL_SHRINK, false, [](VM *vm, Value *args) {
+        AS(args[0], List)->shrink();
+    }},
+    {SYMBOL_CAPACITY, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], List)->capacity);
+    }},
+    {SYMBOL_PARALLEL_MAP, false, [](VM *vm, Value *args) {
+        RETURN(parallelMap(vm, AS(args[0], List), args[1]));
+    }},
+    {SYMBOL_PARALLEL_REDUCE, false, [](VM *vm, Value *args) {
+        RETURN(parallelReduce(vm, AS(args[0], List), args[1], args[2]));
+    }},
+    // sort() or sort(compare); see parallelSort.
+    {SYMBOL_SORT, false, [](VM *vm, Value *args) {
+        parallelSort(vm, AS(args[0], List), vm->argCount > 0 ? &args[1] : nullptr);
+    }},
+    // binarySearch(value) or binarySearch(value, compare) on a list sorted
+    // the same way: the index of the first item equal to value, or -1.
+    {SYMBOL_BINARY_SEARCH, false, [](VM *vm, Value *args) {
+        Value list = args[0];
+        Value needle = args[1];
+        bool custom = vm->argCount > 1;
+
+        // args[2] is only there when a comparator was passed.
+        Value fn = custom ? args[2] : newInt(0);
+
+        // Where item goes relative to needle. compare may change the list,
+        // so items are read from it afresh.
+        auto order = [&](int i) {
+            Value item = AS(list, List)->items[i];
+
+            if (!custom)
+                return compareNative(vm, item, needle);
+
+            Value pair[2] = {item, needle};
+            Value result = vm->call(fn, pair, 2);
+
+            if (result.isObject)
+                abort("Comparator must return a number.");
+
+            double n = asNum(result);
+            return (n > 0) - (n < 0);
+        };
+
+        int low = 0;
+        int high = AS(list, List)->size;
+
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+
+            if (order(middle) < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        bool found = low < AS(list, List)->size && order(low) == 0;
+        RETURN_INT(found ? low : -1);
+    }},
+    // The index of the first item equal to value, or -1. Numbers compare by
+    // value, strings by content and anything else by identity.
+    {SYMBOL_INDEX_OF, true, [](VM *vm, Value *args) {
+        List *list = AS(args[0], List);
+        Value needle = args[1];
+        Value *items = list->items;
+        int found = -1;
+
+        if (!needle.isObject) {
+            double n = asNum(needle);
+
+            for (int i = 0; i < list->size && found < 0; i++) {
+                if (!items[i].isObject && asNum(items[i]) == n)
+                    found = i;
+            }
+        } else if (needle.as.object->classObject == vm->strClass ||
+                   needle.as.object->classObject == vm->stringViewClass) {
+            std::string s = text(vm, needle);
+
+            for (int i = 0; i < list->size && found < 0; i++) {
+                if (items[i].isObject && items[i].as.object->classObject == vm->strClass &&
+                    AS(items[i], String)->value == s)
+                    found = i;
+            }
+        } else {
+            for (int i = 0; i < list->size && found < 0; i++) {
+                if (items[i].isObject && items[i].as.object == needle.as.object)
+                    found = i;
+            }
+        }
+
+        RETURN_INT(found);
+    }},
+    // Lists start lazy pipelines; see sequenceMethods.
+    {SYMBOL_MAP, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(listSequence(vm, args[0])->then(vm, stage(Sequence::Stage::MAP, args[1]))));
+    }},
+    {SYMBOL_FILTER, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(listSequence(vm, args[0])->then(vm, stage(Sequence::Stage::FILTER, args[1]))));
+    }},
+    {SYMBOL_TAKE, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(listSequence(vm, args[0])->then(vm, stage(Sequence::Stage::TAKE, newInt(0),
+                                                                       asInt(args[1])))));
+    }},
+    {SYMBOL_REDUCE, false, [](VM *vm, Value *args) {
+        Value list = args[0];
+        Value acc[2] = {args[2], args[1]};
+        Value fn = acc[1];
+
+        for (int i = 0; i < AS(list, List)->size; i++) {
+            acc[1] = AS(list, List)->items[i];
+            acc[0] = retain(vm, vm->call(fn, acc, 2));
+        }
+
+        RETURN(acc[0]);
+    }},
+};
+
+static const NativeMethod coroutineMethods[] = {
+    {SYMBOL_ALIVE, false, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], Coroutine)->state != Coroutine::DONE);
+    }},
+};
+
+// Stages only extend the pipeline; reduce, sum, toList and for loops run it.
+static const NativeMethod sequenceMethods[] = {
+    {SYMBOL_MAP, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(AS(args[0], Sequence)->then(vm, stage(Sequence::Stage::MAP, args[1]))));
+    }},
+    {SYMBOL_FILTER, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(AS(args[0], Sequence)->then(vm, stage(Sequence::Stage::FILTER, args[1]))));
+    }},
+    {SYMBOL_TAKE, false, [](VM *vm, Value *args) {
+        RETURN(sequenceValue(AS(args[0], Sequence)->then(vm, stage(Sequence::Stage::TAKE, newInt(0),
+                                                                   asInt(args[1])))));
+    }},
+    {SYMBOL_REDUCE, false, [](VM *vm, Value *args) {
+        Sequence *cursor = AS(args[0], Sequence)->cursor(vm);
+        Value acc[2] = {args[2], args[1]};
+        Value fn = acc[1];
+
+        while (cursor->next(vm, &acc[1]))
+            acc[0] = retain(vm, vm->call(fn, acc, 2));
+
+        delete cursor;
+        RETURN(acc[0]);
+    }},
+    {SYMBOL_SUM, false, [](VM *vm, Value *args) {
+        Sequence *cursor = AS(args[0], Sequence)->cursor(vm);
+        Value total = newInt(0);
+        Value item;
+
+        while (cursor->next(vm, &item))
+            total = numAdd(total, item);
+
+        delete cursor;
+        RETURN(total);
+    }},
+    {SYMBOL_TO_LIST, false, [](VM *vm, Value *args) {
+        Sequence *cursor = AS(args[0], Sequence)->cursor(vm);
+        Value list = newList(vm);
+        Value item;
+
+        while (cursor->next(vm, &item))
+            AS(list, List)->add(retain(vm, item));
+
+        delete cursor;
+        RETURN(list);
+    }},
+};
+
+static const NativeMethod float64ArrayMethods[] = {
+    {SYMBOL_SIZE, true, [](VM *vm, Value *args) {
+        RETURN_INT(AS(args[0], Float64Array)->size);
+    }},
+    {SYMBOL_GET, true, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        RETURN_NUM(array->items[toIndex(args[1], array->size)]);
+    }},
+    {SYMBOL_SET, false, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        array->items[toIndex(args[1], array->size)] = asNum(args[2]);
+    }},
+    {SYMBOL_SUM, true, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        RETURN_NUM(simdSum(array->items, array->size));
+    }},
+    {SYMBOL_MIN, true, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        RETURN_NUM(simdMin(array->items, array->size));
+    }},
+    {SYMBOL_MAX, true, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        RETURN_NUM(simdMax(array->items, array->size));
+    }},
+    {SYMBOL_DOT, true, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        Float64Array *other = toFloat64Array(vm, args[1]);
+
+        if (array->size != other->size)
+            abort("float64Array sizes differ.");
+
+        RETURN_NUM(simdDot(array->items, other->items, array->size));
+    }},
+    {SYMBOL_SCALE, false, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        simdScale(array->items, array->size, asNum(args[1]));
+    }},
+    {SYMBOL_ADD, false, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        Float64Array *other = toFloat64Array(vm, args[1]);
+
+        if (array->size != other->size)
+            abort("float64Array sizes differ.");
+
+        simdAdd(array->items, other->items, array->size);
+    }},
+    {SYMBOL_FILL, false, [](VM *vm, Value *args) {
+        Float64Array *array = AS(args[0], Float64Array);
+        simdFill(array->items, array->size, asNum(args[1]));
+    }},
+};
+
+// The core classes and global functions are the same for every VM and are
+// never changed, so they are built once per process and shared.
+struct CoreLibrary {
+    ObjectClass numClass;
+    ObjectClass strClass;
+    ObjectClass listClass;
+    ObjectClass float64ArrayClass;
+    ObjectClass functionClass;
+    ObjectClass closureClass;
+    ObjectClass coroutineClass;
+    ObjectClass sequenceClass;
+    ObjectClass fileClass;
+    ObjectClass stringViewClass;
+    ObjectClass mapClass;
+    ObjectClass jsonClass;
+
+    // The value of the json global, which only has methods.
+    Object json;
+
+    std::vector<Value> globals;
+
+    std::map<std::string, int> symbols;
+    std::map<std::string, int> globalSlots;
+};
+
+template <int N>
+static void addMethods(ObjectClass &classObject, const NativeMethod (&methods)[N]) {
+    for (auto &method : methods) {
+        classObject.methods[method.symbol] = method.fn;
+        classObject.pure[method.symbol] = method.pure;
+    }
+}
+
+static CoreLibrary *buildCore() {
+    CoreLibrary *core = new CoreLibrary();
+
+    addMethods(core->numClass, numMethods);
+    addMethods(core->strClass, strMethods);
+    addMethods(core->listClass, listMethods);
+    addMethods(core->float64ArrayClass, float64ArrayMethods);
+    addMethods(core->coroutineClass, coroutineMethods);
+    addMethods(core->sequenceClass, sequenceMethods);
+    addMethods(core->fileClass, fileMethods);
+    addMethods(core->stringViewClass, stringViewMethods);
+    addMethods(core->mapClass, mapMethods);
+    addMethods(core->jsonClass, jsonMethods);
+
+    for (int i = 0; i < CORE_SYMBOLS; i++)
+        core->symbols[coreSymbolNames[i]] = i;
+
+    for (auto &global : coreGlobals) {
+        Function *function = new Function(&core->functionClass);
+        function->foreign = true;
+        function->arity = global.arity;
+        function->body = global.fn;
+
+        Value value;
+        value.isObject = true;
+        value.isInt = false;
+        value.as.object = function;
+
+        core->globalSlots[global.name] = core->globals.size();
+        core->globals.push_back(value);
+    }
+
+    core->json.classObject = &core->jsonClass;
+    core->globalSlots["json"] = core->globals.size();
+    core->globals.push_back(objectValue(&core->json));
+
+    return core;
+}
+
+static CoreLibrary &coreLibrary() {
+    static CoreLibrary *core = buildCore();
+    return *core;
+}
+
+int findCoreSymbol(const std::string &name) {
+    auto &symbols = coreLibrary().symbols;
+    auto it = symbols.find(name);
+    return it == symbols.end() ? -1 : it->second;
+}
+
+int findCoreGlobal(const std::string &name) {
+    auto &slots = coreLibrary().globalSlots;
+    auto it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+const std::vector<Value> &coreGlobalValues() {
+    return coreLibrary().globals;
+}
+
+void initCore(VM &vm) {
+    CoreLibrary &core = coreLibrary();
 
-        if (index < 0 || index >= list->size)
-            printf("Index out of bounds\n");
+    vm.numClass = &core.numClass;
+    vm.strClass = &core.strClass;
+    vm.listClass = &core.listClass;
+    vm.float64ArrayClass = &core.float64ArrayClass;
+    vm.functionClass = &core.functionClass;
+    vm.closureClass = &core.closureClass;
+    vm.coroutineClass = &core.coroutineClass;
+    vm.sequenceClass = &core.sequenceClass;
+    vm.fileClass = &core.fileClass;
+    vm.stringViewClass = &core.stringViewClass;
+    vm.mapClass = &core.mapClass;
+    vm.jsonClass = &core.jsonClass;
 
-        RETURN(list->items[index]);
-    };
-}
\ No newline at end of file
+    vm.memory = core.globals;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+
+#include "value.hpp"
+
+static void collectFunctions(VM *vm, const std::vector<Value> &constants,
+                             std::vector<Function *> &out, std::set<Function *> &seen) {
+    for (auto &constant : constants) {
+        if (!constant.isObject || constant.as.object->classObject != vm->functionClass)
+            continue;
+
+        Function *fn = AS(constant, Function);
+        if (fn->foreign || seen.count(fn))
+            continue;
+
+        seen.insert(fn);
+        out.push_back(fn);
+        collectFunctions(vm, fn->constants, out, seen);
+    }
+}
+
+std::vector<Function *> scriptFunctions(VM *vm) {
+    std::vector<Function *> out;
+    std::set<Function *> seen;
+
+    collectFunctions(vm, vm->compiler->constants, out, seen);
+    return out;
+}
+
+static std::string quote(const std::string &s) {
+    std::string out = "\"";
+
+    for (unsigned char c : s) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n\"\n    \"";
+        } else if (c < 32 || c >= 127) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\%03o", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+
+    return out + "\"";
+}
+
+// One statement per instruction; labels only where something jumps to.
+static void emitBody(std::ostream &out, const std::vector<uint8_t> &code, bool topLevel) {
+    std::set<int> targets;
+    // Stores straight after ITER_NEXT, which set the loop variable.
+    std::set<int> loopStores;
+
+    for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+        switch (code[pc]) {
+            case JUMP:
+            case JEQ:
+                targets.insert(pc + 1 + code[pc + 1]);
+                break;
+            case JUMP_BACK:
+                targets.insert(pc + 1 - code[pc + 1]);
+                break;
+            case ITER_NEXT:
+                targets.insert(pc + 2 + code[pc + 2]);
+                loopStores.insert(pc + instructionLength(ITER_NEXT));
+                break;
+        }
+    }
+
+    for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+        if (targets.count(pc))
+            out << "L" << pc << ":\n";
+
+        int a = pc + 1 < code.size() ? code[pc + 1] : 0;
+        int b = pc + 2 < code.size() ? code[pc + 2] : 0;
+
+        out << "    ";
+
+        switch (code[pc]) {
+            case MOVB: out << "Runtime::push(vm, &k[" << a << "]);"; break;
+            case JUMP: out << "goto L" << pc + 1 + a << ";"; break;
+            case JUMP_BACK: out << "goto L" << pc + 1 - a << ";"; break;
+            case JEQ: out << "if (Runtime::isFalse(vm)) goto L" << pc + 1 + a << ";"; break;
+            case ITER_INIT: out << "Runtime::iterInit(vm, " << a << ");"; break;
+            case ITER_NEXT:
+                out << "if (!Runtime::iterNext(vm, " << a << ")) goto L" << pc + 2 + b << ";";
+                break;
+            case INDEX_GET: out << "Runtime::indexGet(vm);"; break;
+            case INDEX_SET: out << "Runtime::indexSet(vm);"; break;
+            case NEW_LIST: out << "Runtime::buildList(vm, " << a << ");"; break;
+            case MEM: out << "Runtime::mem(vm, " << a << ");"; break;
+            case MEMSET:
+                if (loopStores.count(pc))
+                    out << "Runtime::loopSet(vm, " << a << ");";
+                else
+                    out << "Runtime::memSet(vm, " << a << ");";
+                break;
+            case GLOBAL: out << "Runtime::global(vm, " << a << ");"; break;
+            case GET_UPVAL: out << "Runtime::getUpvalue(vm, " << a << ");"; break;
+            case SET_UPVAL: out << "Runtime::setUpvalue(vm, " << a << ");"; break;
+            case CLOSURE: out << "Runtime::closure(vm, AS(k[" << a << "], Function));"; break;
+            case POP: out << "Runtime::pop(vm);"; break;
+            case ADD: out << "Runtime::add(vm);"; break;
+            case SUB: out << "Runtime::sub(vm);"; break;
+            case MUL: out << "Runtime::mul(vm);"; break;
+            case DIV: out << "Runtime::div(vm);"; break;
+            case LT: out << "Runtime::lt(vm);"; break;
+            case GT: out << "Runtime::gt(vm);"; break;
+            case LTEQ: out << "Runtime::lteq(vm);"; break;
+            case GTEQ: out << "Runtime::gteq(vm);"; break;
+            case CALL: out << "Runtime::callMethod(vm, " << a << ", " << b << ");"; break;
+            case CALL_FUNC: out << "Runtime::callFunction(vm, " << a << ");"; break;
+            case TAIL_CALL:
+                out << "{\n"
+                    << "        void *next = Runtime::tailCall(vm, " << a << ");\n"
+                    << "        if (next == Runtime::finished()) return;\n"
+                    << "        if (next != nullptr) return reinterpret_cast<void (*)(VM *)>(next)(vm);\n"
+                    << "    }";
+                break;
+            case DEL: out << "Runtime::del(vm);"; break;
+            case RETURN:
+                out << (topLevel ? "return;" : "Runtime::ret(vm); return;");
+                break;
+            default:
+                abort("Cannot emit opcode " + std::to_string(code[pc]) + ".");
+        }
+
+        out << "\n";
+    }
+}
+
+void emitCpp(VM *vm, const std::vector<uint8_t> &code, const std::string &source, std::ostream &out) {
+    std::vector<Function *> fns = scriptFunctions(vm);
+
+    out << "// Generated by --emit-cpp. Build with the runtime sources and -DNO_MAIN.\n\n"
+        << "#include \"value.hpp\"\n"
+        << "#include \"runtime.hpp\"\n\n"
+        << "static Function *loaded[" << fns.size() + 1 << "];\n\n";
+
+    for (int i = 0; i < fns.size(); i++)
+        out << "static void f" << i << "(VM *vm);\n";
+
+    for (int i = 0; i < fns.size(); i++) {
+        out << "\nstatic void f" << i << "(VM *vm) {\n"
+            << "    Value *k = loaded[" << i << "]->constants.data();\n";
+        emitBody(out, fns[i]->code, false);
+        out << "}\n";
+    }
+
+    out << "\nstatic void top(VM *vm) {\n"
+        << "    Value *k = vm->compiler->constants.data();\n";
+    emitBody(out, code, true);
+    out << "}\n\n";
+
+    // The source is compiled again at startup to rebuild constants, globals
+    // and symbols; the sizes catch a runtime whose compiler has changed.
+    out << "static const char *source =\n    " << quote(source) << ";\n\n"
+        << "static const size_t sizes[] = {";
+    for (Function *fn : fns)
+        out << fn->code.size() << ", ";
+    out << "0};\n\n"
+        << "static void (*natives[])(VM *) = {";
+    for (int i = 0; i < fns.size(); i++)
+        out << "f" << i << ", ";
+    out << "nullptr};\n\n";
+
+    out << "int main() {\n"
+        << "    VM vm;\n"
+        << "    vm.inlining = " << (vm->inlining ? "true" : "false") << ";\n\n"
+        << "    try {\n"
+        << "        std::vector<uint8_t> code = vm.compile(source);\n"
+        << "        std::vector<Function *> fns = scriptFunctions(&vm);\n\n"
+        << "        if (code.size() != " << code.size() << " || fns.size() != " << fns.size() << ")\n"
+        << "            abort(\"Script does not match the emitted program.\");\n\n"
+        << "        for (int i = 0; i < fns.size(); i++) {\n"
+        << "            if (fns[i]->code.size() != sizes[i])\n"
+        << "                abort(\"Script does not match the emitted program.\");\n\n"
+        << "            loaded[i] = fns[i];\n"
+        << "            fns[i]->native = natives[i];\n"
+        << "        }\n\n"
+        << "        top(&vm);\n"
+        << "    } catch (ScriptError &e) {\n"
+        << "        vm.output.flush();\n"
+        << "        error(e.message);\n"
+        << "    }\n\n"
+        << "    return 0;\n"
+        << "}\n";
+}
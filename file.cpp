@@ -0,0 +1,55 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "value.hpp"
+
+File::File(VM *vm) :
+    data(nullptr),
+    size(0)
+{
+    classObject = vm->fileClass;
+}
+
+StringView::StringView(VM *vm) :
+    data(nullptr),
+    size(0)
+{
+    classObject = vm->stringViewClass;
+}
+
+// Pages are mapped rather than read, so scanning a file costs no copies
+// and the kernel reads ahead of the sequential pass.
+File *openFile(VM *vm, const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        abort("Cannot open " + path + ".");
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        abort("Cannot open " + path + ".");
+    }
+
+    File *file = new File(vm);
+    file->size = info.st_size;
+    file->path = path;
+
+    // mmap refuses empty mappings; an empty file has no bytes to point at.
+    if (file->size > 0) {
+        void *data = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED) {
+            close(fd);
+            delete file;
+            abort("Cannot map " + path + ".");
+        }
+
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = static_cast<const char *>(data);
+    }
+
+    close(fd);
+    return file;
+}
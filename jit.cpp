@@ -0,0 +1,339 @@
+#include "value.hpp"
+#include "runtime.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <string.h>
+#include <sys/mman.h>
+
+// From libgcc: makes the unwinder aware of an .eh_frame built at runtime.
+extern "C" void __register_frame(void *begin);
+
+// Emits the machine code templates. The VM pointer lives in rbx for the
+// whole function; every opcode loads its operands as immediates and calls
+// into Runtime, with jumps and branches done natively.
+struct Assembler {
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b) {
+        code.push_back(b);
+    }
+
+    void bytes(std::initializer_list<uint8_t> bs) {
+        code.insert(code.end(), bs);
+    }
+
+    void imm32(int32_t v) {
+        uint8_t *p = reinterpret_cast<uint8_t *>(&v);
+        code.insert(code.end(), p, p + 4);
+    }
+
+    void imm64(uint64_t v) {
+        uint8_t *p = reinterpret_cast<uint8_t *>(&v);
+        code.insert(code.end(), p, p + 8);
+    }
+
+    // push rbx; mov rbx, rdi
+    void prologue() {
+        bytes({0x53, 0x48, 0x89, 0xFB});
+    }
+
+    // pop rbx; ret
+    void epilogue() {
+        bytes({0x5B, 0xC3});
+    }
+
+    // mov rdi, rbx; [mov rsi, a]; [mov edx, b]; mov rax, fn; call rax
+    void call(void *fn, int args = 0, int64_t a = 0, int32_t b = 0) {
+        bytes({0x48, 0x89, 0xDF});
+
+        if (args >= 1) {
+            bytes({0x48, 0xBE});
+            imm64(a);
+        }
+        if (args >= 2) {
+            byte(0xBA);
+            imm32(b);
+        }
+
+        bytes({0x48, 0xB8});
+        imm64(reinterpret_cast<uint64_t>(fn));
+        bytes({0xFF, 0xD0});
+    }
+
+    // test al, al
+    void testResult() {
+        bytes({0x84, 0xC0});
+    }
+
+    // Jump opcodes with a rel32 to patch; returns where the rel32 is.
+    int jump(std::initializer_list<uint8_t> opcode) {
+        bytes(opcode);
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    void patch(int at, int target) {
+        int32_t rel = target - (at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+};
+
+// Call frame information for code at [begin, begin + size), so a ScriptError
+// thrown by a helper can unwind through it. Every call is made with rbx
+// pushed and nothing else, so one rule covers the whole code: the caller's
+// stack pointer is rsp + 16, the return address is at rsp + 8 and rbx at rsp.
+static std::vector<uint8_t> unwindInfo(uint64_t begin, uint64_t size) {
+    std::vector<uint8_t> cie = {
+        0, 0, 0, 0,         // length
+        0, 0, 0, 0,         // CIE id
+        1, 'z', 'R', 0,     // version, augmentation
+        1, 0x78, 16,        // code align 1, data align -8, return address rip
+        1, 0x00,            // absolute pointers
+        0x0C, 7, 8,         // cfa = rsp + 8
+        0x90, 1,            // rip at cfa - 8
+    };
+    std::vector<uint8_t> fde = {
+        0, 0, 0, 0,         // length
+        0, 0, 0, 0,         // offset back to the CIE
+    };
+
+    Assembler a;
+    a.imm64(begin);
+    a.imm64(size);
+    fde.insert(fde.end(), a.code.begin(), a.code.end());
+    fde.insert(fde.end(), {
+        0,                  // no augmentation data
+        0x0E, 16,           // cfa = rsp + 16
+        0x83, 2,            // rbx at cfa - 16
+    });
+
+    std::vector<uint8_t> out;
+    for (auto *entry : {&cie, &fde}) {
+        while (entry->size() % 8 != 0)
+            entry->push_back(0);
+
+        uint32_t length = entry->size() - 4;
+        memcpy(entry->data(), &length, 4);
+
+        if (entry == &fde) {
+            uint32_t back = out.size() + 4;
+            memcpy(entry->data() + 4, &back, 4);
+        }
+
+        out.insert(out.end(), entry->begin(), entry->end());
+    }
+
+    out.insert(out.end(), {0, 0, 0, 0});
+    return out;
+}
+
+#define HELPER(name) reinterpret_cast<void *>(&Runtime::name)
+
+bool jitCompile(VM *vm, Function *fn) {
+    std::vector<uint8_t> &code = fn->code;
+
+    // Templates trust operands and jump targets.
+    if (!fn->verified)
+        return false;
+
+    Assembler a;
+    std::map<int, int> offsets;
+    std::vector<std::pair<int, int> > branches;
+    std::set<int> headers;
+
+    // A store straight after ITER_NEXT sets the loop variable.
+    std::set<int> loopStores;
+    for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+        if (code[pc] == ITER_NEXT)
+            loopStores.insert(pc + instructionLength(ITER_NEXT));
+    }
+
+    a.prologue();
+
+    for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+        offsets[pc] = a.code.size();
+
+        switch (code[pc]) {
+            case MOVB:
+                a.call(HELPER(push), 1, reinterpret_cast<int64_t>(&fn->constants[code[pc + 1]]));
+                break;
+
+            case JUMP:
+                branches.push_back({a.jump({0xE9}), pc + 1 + code[pc + 1]});
+                break;
+
+            case JUMP_BACK:
+                headers.insert(pc + 1 - code[pc + 1]);
+                branches.push_back({a.jump({0xE9}), pc + 1 - code[pc + 1]});
+                break;
+
+            case JEQ:
+                a.call(HELPER(isFalse));
+                a.testResult();
+                branches.push_back({a.jump({0x0F, 0x85}), pc + 1 + code[pc + 1]});
+                break;
+
+            case ITER_INIT:
+                a.call(HELPER(iterInit), 1, code[pc + 1]);
+                break;
+
+            case ITER_NEXT:
+                a.call(HELPER(iterNext), 1, code[pc + 1]);
+                a.testResult();
+                branches.push_back({a.jump({0x0F, 0x84}), pc + 2 + code[pc + 2]});
+                break;
+
+            case INDEX_GET:
+                a.call(HELPER(indexGet));
+                break;
+
+            case INDEX_SET:
+                a.call(HELPER(indexSet));
+                break;
+
+            case NEW_LIST:
+                a.call(HELPER(buildList), 1, code[pc + 1]);
+                break;
+
+            case MEM:
+                a.call(HELPER(mem), 1, code[pc + 1]);
+                break;
+
+            case MEMSET:
+                if (loopStores.count(pc))
+                    a.call(HELPER(loopSet), 1, code[pc + 1]);
+                else
+                    a.call(HELPER(memSet), 1, code[pc + 1]);
+                break;
+
+            case GLOBAL:
+                a.call(HELPER(global), 1, code[pc + 1]);
+                break;
+
+            case GET_UPVAL:
+                a.call(HELPER(getUpvalue), 1, code[pc + 1]);
+                break;
+
+            case SET_UPVAL:
+                a.call(HELPER(setUpvalue), 1, code[pc + 1]);
+                break;
+
+            case CLOSURE:
+                a.call(HELPER(closure), 1,
+                       reinterpret_cast<int64_t>(AS(fn->constants[code[pc + 1]], Function)));
+                break;
+
+            case POP:
+                a.call(HELPER(pop));
+                break;
+
+            case ADD: a.call(HELPER(add)); break;
+            case SUB: a.call(HELPER(sub)); break;
+            case MUL: a.call(HELPER(mul)); break;
+            case DIV: a.call(HELPER(div)); break;
+            case LT: a.call(HELPER(lt)); break;
+            case GT: a.call(HELPER(gt)); break;
+            case LTEQ: a.call(HELPER(lteq)); break;
+            case GTEQ: a.call(HELPER(gteq)); break;
+
+            case CALL:
+                a.call(HELPER(callMethod), 2, code[pc + 1], code[pc + 2]);
+                break;
+
+            case CALL_FUNC:
+                a.call(HELPER(callFunction), 1, code[pc + 1]);
+                break;
+
+            case TAIL_CALL: {
+                a.call(HELPER(tailCall), 1, code[pc + 1]);
+
+                // test rax, rax; jz next
+                a.bytes({0x48, 0x85, 0xC0});
+                int next = a.jump({0x0F, 0x84});
+
+                // cmp rax, 1; je done
+                a.bytes({0x48, 0x83, 0xF8, 0x01});
+                int done = a.jump({0x0F, 0x84});
+
+                // mov rdi, rbx; pop rbx; jmp rax
+                a.bytes({0x48, 0x89, 0xDF, 0x5B, 0xFF, 0xE0});
+
+                a.patch(done, a.code.size());
+                a.epilogue();
+
+                a.patch(next, a.code.size());
+                break;
+            }
+
+            case DEL:
+                a.call(HELPER(del));
+                break;
+
+            case RETURN:
+                a.call(HELPER(ret));
+                a.epilogue();
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    for (auto &branch : branches) {
+        auto target = offsets.find(branch.second);
+        if (target == offsets.end())
+            return false;
+
+        a.patch(branch.first, target->second);
+    }
+
+    // OSR entries: the interpreter jumps into a loop header with the
+    // frame already set up, so each one only needs the prologue.
+    std::map<int, int> stubs;
+    for (int header : headers) {
+        auto target = offsets.find(header);
+        if (target == offsets.end())
+            return false;
+
+        stubs[header] = a.code.size();
+        a.prologue();
+        a.patch(a.jump({0xE9}), target->second);
+    }
+
+    // The unwind info follows the code, aligned, in the same mapping.
+    size_t codeSize = (a.code.size() + 7) & ~size_t(7);
+    size_t size = codeSize + unwindInfo(0, 0).size();
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    uint8_t *base = static_cast<uint8_t *>(memory);
+    std::vector<uint8_t> unwind = unwindInfo(reinterpret_cast<uint64_t>(base), a.code.size());
+
+    memcpy(base, a.code.data(), a.code.size());
+    memcpy(base + codeSize, unwind.data(), unwind.size());
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return false;
+    }
+
+    __register_frame(base + codeSize);
+
+    fn->native = reinterpret_cast<void (*)(VM *)>(base);
+
+    for (auto &stub : stubs)
+        fn->entries[stub.first] = reinterpret_cast<void (*)(VM *)>(base + stub.second);
+
+    return true;
+}
+
+#else
+
+bool jitCompile(VM *vm, Function *fn) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,544 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "value.hpp"
+#include "simd.hpp"
+
+// Deeper than this is a cycle when writing, and would run out of native
+// stack when reading.
+static const int MAX_DEPTH = 1000;
+
+// Distinct object keys the parser shares; documents with more than this
+// are unlikely to repeat them.
+static const int MAX_KEYS = 4096;
+
+// Decimal powers a double holds exactly, so a mantissa of up to 15 digits
+// scaled by one of them is correctly rounded without strtod.
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static void appendUtf8(std::string &out, uint32_t code) {
+    if (code < 0x80) {
+        out += (char) code;
+    } else if (code < 0x800) {
+        out += (char) (0xc0 | code >> 6);
+        out += (char) (0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += (char) (0xe0 | code >> 12);
+        out += (char) (0x80 | (code >> 6 & 0x3f));
+        out += (char) (0x80 | (code & 0x3f));
+    } else {
+        out += (char) (0xf0 | code >> 18);
+        out += (char) (0x80 | (code >> 12 & 0x3f));
+        out += (char) (0x80 | (code >> 6 & 0x3f));
+        out += (char) (0x80 | (code & 0x3f));
+    }
+}
+
+// One pass over the text, building values as it goes. Elements of the
+// arrays and objects still open wait on one shared stack, so each List and
+// Map is allocated once, at its final size, when it closes.
+struct JsonParser {
+    VM *vm;
+    const char *start;
+    const char *p;
+    const char *end;
+
+    std::vector<Value> pending;
+    // Reused for strings with escapes and for numbers strtod reads.
+    std::string text;
+    int depth;
+
+    // Object keys seen so far. Strings never change, so every object with
+    // a key shares one String for it.
+    std::unordered_map<std::string, Value> keys;
+
+    void fail(const std::string &what) {
+        abort("Invalid JSON at offset " + std::to_string(p - start) + ": " + what + ".");
+    }
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            p++;
+    }
+
+    void expect(char c) {
+        skipSpace();
+        if (p >= end || *p != c)
+            fail(std::string("expected '") + c + "'");
+        p++;
+    }
+
+    Value value() {
+        skipSpace();
+        if (p >= end)
+            fail("unexpected end");
+
+        switch (*p) {
+            case '{': return object();
+            case '[': return array();
+            case '"': return string();
+            case 't': return literal("true", 1);
+            case 'f': return literal("false", 0);
+            case 'n': return literal("null", 0);
+            default:
+                if (*p == '-' || (*p >= '0' && *p <= '9'))
+                    return number();
+                fail("unexpected character");
+                return newInt(0);
+        }
+    }
+
+    Value literal(const char *word, int64_t value) {
+        int length = strlen(word);
+        if (end - p < length || memcmp(p, word, length) != 0)
+            fail("unexpected character");
+
+        p += length;
+        return newInt(value);
+    }
+
+    void enter() {
+        if (++depth > MAX_DEPTH)
+            fail("nested too deeply");
+        p++;
+        skipSpace();
+    }
+
+    Value array() {
+        enter();
+        int base = pending.size();
+
+        if (p < end && *p == ']') {
+            p++;
+        } else {
+            while (true) {
+                pending.push_back(value());
+                skipSpace();
+
+                if (p < end && *p == ',') {
+                    p++;
+                } else {
+                    expect(']');
+                    break;
+                }
+            }
+        }
+
+        Value list = newList(vm);
+        AS(list, List)->reserve(pending.size() - base);
+        AS(list, List)->addAll(pending.data() + base, pending.size() - base);
+        pending.resize(base);
+
+        depth--;
+        return list;
+    }
+
+    Value object() {
+        enter();
+        int base = pending.size();
+
+        if (p < end && *p == '}') {
+            p++;
+        } else {
+            while (true) {
+                skipSpace();
+                if (p >= end || *p != '"')
+                    fail("expected a string key");
+
+                pending.push_back(key());
+                expect(':');
+                pending.push_back(value());
+                skipSpace();
+
+                if (p < end && *p == ',') {
+                    p++;
+                } else {
+                    expect('}');
+                    break;
+                }
+            }
+        }
+
+        Value value = newMap(vm);
+        Map *map = AS(value, Map);
+        map->entries.reserve((pending.size() - base) / 2);
+
+        for (int i = base; i < pending.size(); i += 2) {
+            String *key = AS(pending[i], String);
+            int found = map->find(key->value);
+
+            // The last of repeated keys wins, as in JavaScript.
+            if (found >= 0)
+                map->entries[found].value = pending[i + 1];
+            else
+                map->put(key, pending[i + 1]);
+        }
+
+        pending.resize(base);
+
+        depth--;
+        return value;
+    }
+
+    Value string() {
+        const char *begin = ++p;
+        p = simdScanString(p, end);
+
+        // Most strings have no escapes and are copied straight out.
+        if (p < end && *p == '"')
+            return newString(vm, std::string(begin, p++ - begin));
+
+        text.assign(begin, p - begin);
+
+        while (true) {
+            if (p >= end)
+                fail("unterminated string");
+
+            if (*p == '"') {
+                p++;
+                return newString(vm, text);
+            }
+
+            if (*p != '\\')
+                fail("control character in string");
+
+            if (++p >= end)
+                fail("unterminated string");
+
+            switch (*p++) {
+                case '"': text += '"'; break;
+                case '\\': text += '\\'; break;
+                case '/': text += '/'; break;
+                case 'b': text += '\b'; break;
+                case 'f': text += '\f'; break;
+                case 'n': text += '\n'; break;
+                case 'r': text += '\r'; break;
+                case 't': text += '\t'; break;
+                case 'u': {
+                    uint32_t code = hex();
+
+                    // A high surrogate followed by a low one is one code point.
+                    if (code >= 0xd800 && code < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                        const char *low = p;
+                        p += 2;
+                        uint32_t second = hex();
+
+                        if (second >= 0xdc00 && second < 0xe000)
+                            code = 0x10000 + ((code - 0xd800) << 10) + (second - 0xdc00);
+                        else
+                            p = low;
+                    }
+
+                    appendUtf8(text, code);
+                    break;
+                }
+                default:
+                    p--;
+                    fail("invalid escape");
+            }
+
+            const char *run = p;
+            p = simdScanString(p, end);
+            text.append(run, p - run);
+        }
+    }
+
+    Value key() {
+        const char *begin = p + 1;
+        const char *close = simdScanString(begin, end);
+
+        if (close < end && *close == '"') {
+            text.assign(begin, close - begin);
+
+            auto known = keys.find(text);
+            if (known != keys.end()) {
+                p = close + 1;
+                return known->second;
+            }
+        }
+
+        Value value = string();
+        const std::string &name = AS(value, String)->value;
+
+        auto known = keys.find(name);
+        if (known != keys.end())
+            return known->second;
+
+        if (keys.size() < MAX_KEYS)
+            keys[name] = value;
+
+        return value;
+    }
+
+    uint32_t hex() {
+        if (end - p < 4)
+            fail("invalid escape");
+
+        uint32_t code = 0;
+
+        for (int i = 0; i < 4; i++, p++) {
+            char c = *p;
+            code <<= 4;
+
+            if (c >= '0' && c <= '9')
+                code |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                code |= c - 'A' + 10;
+            else
+                fail("invalid escape");
+        }
+
+        return code;
+    }
+
+    static bool isDigit(const char *p, const char *end) {
+        return p < end && *p >= '0' && *p <= '9';
+    }
+
+    // Integers that fit stay integers. Other numbers with few enough digits
+    // are scaled by an exact power of ten; the rest go to strtod.
+    Value number() {
+        const char *begin = p;
+        bool negative = *p == '-';
+        if (negative)
+            p++;
+
+        if (!isDigit(p, end))
+            fail("invalid number");
+
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        bool integral = true;
+
+        if (*p == '0') {
+            p++;
+        } else {
+            for (; isDigit(p, end); p++, digits++) {
+                if (digits < 19)
+                    mantissa = mantissa * 10 + (*p - '0');
+                else
+                    exponent++;
+            }
+        }
+
+        if (p < end && *p == '.') {
+            integral = false;
+            p++;
+
+            if (!isDigit(p, end))
+                fail("invalid number");
+
+            for (; isDigit(p, end); p++) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    exponent--;
+                    if (mantissa != 0)
+                        digits++;
+                }
+            }
+        }
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            integral = false;
+            p++;
+
+            bool negativeExponent = false;
+            if (p < end && (*p == '+' || *p == '-'))
+                negativeExponent = *p++ == '-';
+
+            if (!isDigit(p, end))
+                fail("invalid number");
+
+            int written = 0;
+            for (; isDigit(p, end); p++) {
+                if (written < 100000)
+                    written = written * 10 + (*p - '0');
+            }
+
+            exponent += negativeExponent ? -written : written;
+        }
+
+        if (digits < 19) {
+            if (integral && exponent == 0 && mantissa < MAX_INT)
+                return newInt(negative ? -(int64_t) mantissa : (int64_t) mantissa);
+
+            if (mantissa < MAX_INT && exponent >= -22 && exponent <= 22) {
+                double value = exponent < 0 ? mantissa / POWERS_OF_TEN[-exponent]
+                                            : mantissa * POWERS_OF_TEN[exponent];
+                return newNum(negative ? -value : value);
+            }
+        }
+
+        // The mapped text need not end in a terminator, so strtod reads a copy.
+        text.assign(begin, p - begin);
+        return newNum(strtod(text.c_str(), nullptr));
+    }
+};
+
+Value parseJson(VM *vm, const char *data, int64_t size) {
+    JsonParser parser;
+    parser.vm = vm;
+    parser.start = data;
+    parser.p = data;
+    parser.end = data + size;
+    parser.depth = 0;
+
+    Value value = parser.value();
+
+    parser.skipSpace();
+    if (parser.p != parser.end)
+        parser.fail("unexpected text after the value");
+
+    return value;
+}
+
+static void writeInt(std::string &out, int64_t n) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    uint64_t magnitude = n < 0 ? -(uint64_t) n : n;
+
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (n < 0)
+        *--p = '-';
+
+    out.append(p, end - p);
+}
+
+// Whole numbers as integers, others in the fewest digits of %.15g and
+// %.17g that read back as the same double. JSON has no NaN or infinity.
+static void writeJsonNum(std::string &out, double n) {
+    if (!isfinite(n)) {
+        out += "null";
+        return;
+    }
+
+    if (n == floor(n) && fabs(n) < MAX_INT) {
+        writeInt(out, (int64_t) n);
+        return;
+    }
+
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%.15g", n);
+
+    if (strtod(text, nullptr) != n)
+        length = snprintf(text, sizeof(text), "%.17g", n);
+
+    out.append(text, length);
+}
+
+static void writeJsonString(std::string &out, const char *p, const char *end) {
+    static const char hexDigits[] = "0123456789abcdef";
+
+    out += '"';
+
+    while (true) {
+        const char *run = p;
+        p = simdScanString(p, end);
+        out.append(run, p - run);
+
+        if (p >= end)
+            break;
+
+        char c = *p++;
+
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hexDigits[c >> 4];
+                out += hexDigits[c & 0xf];
+        }
+    }
+
+    out += '"';
+}
+
+static void writeJson(VM *vm, std::string &out, Value v, int depth) {
+    if (!v.isObject) {
+        if (v.isInt)
+            writeInt(out, v.as.integer);
+        else
+            writeJsonNum(out, v.as.num);
+        return;
+    }
+
+    if (depth > MAX_DEPTH)
+        abort("Value nested too deeply for JSON.");
+
+    ObjectClass *classObject = v.as.object->classObject;
+
+    if (classObject == vm->strClass) {
+        const std::string &s = AS(v, String)->value;
+        writeJsonString(out, s.data(), s.data() + s.size());
+    } else if (classObject == vm->stringViewClass) {
+        StringView *view = AS(v, StringView);
+        writeJsonString(out, view->data, view->data + view->size);
+    } else if (classObject == vm->listClass) {
+        List *list = AS(v, List);
+
+        out += '[';
+
+        for (int i = 0; i < list->size; i++) {
+            if (i != 0)
+                out += ',';
+
+            writeJson(vm, out, list->items[i], depth + 1);
+        }
+
+        out += ']';
+    } else if (classObject == vm->float64ArrayClass) {
+        Float64Array *array = AS(v, Float64Array);
+
+        out += '[';
+
+        for (int i = 0; i < array->size; i++) {
+            if (i != 0)
+                out += ',';
+
+            writeJsonNum(out, array->items[i]);
+        }
+
+        out += ']';
+    } else if (classObject == vm->mapClass) {
+        Map *map = AS(v, Map);
+
+        out += '{';
+
+        for (int i = 0; i < map->entries.size(); i++) {
+            if (i != 0)
+                out += ',';
+
+            const std::string &key = map->entries[i].key->value;
+            writeJsonString(out, key.data(), key.data() + key.size());
+            out += ':';
+            writeJson(vm, out, map->entries[i].value, depth + 1);
+        }
+
+        out += '}';
+    } else {
+        abort("Cannot convert " + valueToStr(vm, v) + " to JSON.");
+    }
+}
+
+void writeJson(VM *vm, std::string &out, Value v) {
+    writeJson(vm, out, v, 0);
+}
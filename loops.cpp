@@ -0,0 +1,417 @@
+#include <algorithm>
+
+#include "value.hpp"
+
+// A value on the simulated stack: the instructions [first, last] that
+// computed it, if they form an expression that can be hoisted.
+struct Expression {
+    int first;
+    int last;
+
+    bool invariant;
+    // Numeric constants combined by number methods: it can't fail, so it
+    // is safe to evaluate even if the loop body would never have run.
+    bool safe;
+    // Evaluated before anything with side effects in the condition.
+    bool early;
+
+    std::vector<Expression> operands;
+};
+
+struct LoopHoister {
+    VM *vm;
+    std::vector<uint8_t> &code;
+    const std::vector<Value> &constants;
+
+    std::vector<int> pcs;
+    std::set<int> targets;
+    std::set<int> written;
+    bool mutates;
+    bool deletes;
+    // Runs script code: a closure could write any local through an
+    // upvalue, even one made after this loop is compiled.
+    bool calls;
+    // Lets top-level code run, which can change globals.
+    bool yields;
+
+    std::vector<std::pair<int, int> > hoisted;
+
+    LoopHoister(VM *vm, std::vector<uint8_t> &code, const std::vector<Value> &constants) :
+        vm(vm),
+        code(code),
+        constants(constants),
+        mutates(false),
+        deletes(false),
+        calls(false),
+        yields(false)
+    {
+    }
+
+    // A symbol is pure if every class defining it says so. Methods of
+    // lists, arrays, views and maps read state the loop itself could change.
+    bool pureSymbol(int symbol, bool *readsState) {
+        ObjectClass *classes[] = {vm->numClass, vm->strClass, vm->listClass,
+                                  vm->float64ArrayClass, vm->functionClass, vm->closureClass,
+                                  vm->coroutineClass, vm->sequenceClass, vm->fileClass,
+                                  vm->stringViewClass, vm->mapClass, vm->jsonClass};
+        bool defined = false;
+        *readsState = false;
+
+        for (ObjectClass *classObject : classes) {
+            if (classObject->methods[symbol] == nullptr)
+                continue;
+            if (!classObject->pure[symbol])
+                return false;
+
+            defined = true;
+            if (classObject == vm->listClass || classObject == vm->float64ArrayClass ||
+                classObject == vm->stringViewClass || classObject == vm->mapClass)
+                *readsState = true;
+        }
+
+        return defined;
+    }
+
+    void scan(int start) {
+        for (int pc = start; pc < code.size(); pc += instructionLength(code[pc])) {
+            pcs.push_back(pc);
+
+            bool readsState;
+
+            switch (code[pc]) {
+                case JUMP:
+                case JEQ:
+                    targets.insert(pc + 1 + code[pc + 1]);
+                    break;
+                case JUMP_BACK:
+                    targets.insert(pc + 1 - code[pc + 1]);
+                    break;
+                case ITER_NEXT:
+                    targets.insert(pc + 2 + code[pc + 2]);
+                    written.insert(code[pc + 1] + 1);
+                    break;
+                case MEMSET:
+                    written.insert(code[pc + 1]);
+                    break;
+                case ITER_INIT:
+                    written.insert(code[pc + 1]);
+                    written.insert(code[pc + 1] + 1);
+                    break;
+                case CALL:
+                    if (!pureSymbol(code[pc + 1], &readsState))
+                        mutates = calls = true;
+                    break;
+                case CALL_FUNC:
+                case TAIL_CALL:
+                case RESUME:
+                    mutates = calls = true;
+                    break;
+                case YIELD:
+                    mutates = calls = yields = true;
+                    break;
+                case INDEX_SET:
+                    mutates = true;
+                    break;
+                case DEL:
+                    deletes = true;
+                    break;
+            }
+        }
+    }
+
+    // Hoists e whole if allowed, otherwise whichever operands are.
+    void collect(const Expression &e) {
+        if (e.invariant && !e.operands.empty() && (e.early || e.safe)) {
+            hoisted.push_back({e.first, e.last});
+            return;
+        }
+
+        for (auto &operand : e.operands)
+            collect(operand);
+    }
+
+    static Expression opaque() {
+        Expression e;
+        e.first = e.last = -1;
+        e.invariant = e.safe = e.early = false;
+        return e;
+    }
+
+    Expression pop(std::vector<Expression> &stack) {
+        if (stack.empty())
+            return opaque();
+
+        Expression e = stack.back();
+        stack.pop_back();
+        return e;
+    }
+
+    void discard(std::vector<Expression> &stack, int count) {
+        for (int i = 0; i < count; i++)
+            collect(pop(stack));
+    }
+
+    // Combines the top count values into the result of instruction i.
+    Expression combine(std::vector<Expression> &stack, int count, int i, bool invariant, bool safe) {
+        Expression e = opaque();
+        e.operands.resize(count);
+
+        for (int n = count - 1; n >= 0; n--)
+            e.operands[n] = pop(stack);
+
+        bool contiguous = true;
+        int next = count > 0 ? e.operands[0].first : i;
+        for (auto &operand : e.operands) {
+            contiguous = contiguous && operand.first == next && operand.first >= 0;
+            next = operand.last + 1;
+            invariant = invariant && operand.invariant;
+            safe = safe && operand.safe;
+        }
+        contiguous = contiguous && next == i;
+
+        if (contiguous && invariant) {
+            e.first = count > 0 ? e.operands[0].first : i;
+            e.last = i;
+            e.invariant = true;
+            e.safe = safe;
+            e.early = e.operands.empty() || e.operands[0].early;
+            return e;
+        }
+
+        for (auto &operand : e.operands)
+            collect(operand);
+
+        return opaque();
+    }
+
+    Expression leaf(int i, bool invariant, bool safe, bool early) {
+        Expression e = opaque();
+        e.first = e.last = i;
+        e.invariant = invariant;
+        e.safe = safe;
+        e.early = early;
+        return e;
+    }
+
+    void run(int condition, const std::set<int> &captured) {
+        std::vector<Expression> stack;
+        bool clean = true;
+
+        for (int i = 0; i < pcs.size(); i++) {
+            int pc = pcs[i];
+            uint8_t op = code[pc];
+            int a = pc + 1 < code.size() ? code[pc + 1] : 0;
+            int b = pc + 2 < code.size() ? code[pc + 2] : 0;
+
+            // Expressions never span control flow; values left on the stack
+            // across it are treated as unknown. The header only loops back.
+            if (i > 0 && targets.count(pc)) {
+                for (auto &e : stack) {
+                    collect(e);
+                    e = opaque();
+                }
+                clean = false;
+            }
+
+            bool early = clean && pc < condition;
+            bool readsState;
+
+            switch (op) {
+                case MOVB:
+                    stack.push_back(leaf(i, true, !constants[a].isObject, early));
+                    break;
+
+                case MEM:
+                    stack.push_back(leaf(i, !written.count(a) && !captured.count(a) && !calls,
+                                         false, early));
+                    break;
+
+                case GLOBAL:
+                    stack.push_back(leaf(i, !yields, false, early));
+                    break;
+
+                case CALL: {
+                    bool pure = pureSymbol(a, &readsState);
+                    bool numeric = vm->numClass->pure[a];
+
+                    stack.push_back(combine(stack, b + 1, i, pure && (!readsState || !mutates),
+                                            numeric));
+                    if (!pure)
+                        clean = false;
+                    break;
+                }
+
+                case INDEX_GET:
+                    stack.push_back(combine(stack, 2, i, !mutates, false));
+                    break;
+
+                case GET_UPVAL:
+                case CLOSURE:
+                    stack.push_back(opaque());
+                    break;
+
+                case NEW_LIST:
+                    discard(stack, a);
+                    stack.push_back(opaque());
+                    break;
+
+                case MEMSET:
+                case POP:
+                case ITER_INIT:
+                    discard(stack, 1);
+                    break;
+
+                case SET_UPVAL:
+                case DEL:
+                case YIELD:
+                    discard(stack, 1);
+                    clean = false;
+                    break;
+
+                case JEQ:
+                    discard(stack, 1);
+                    clean = false;
+                    break;
+
+                case INDEX_SET:
+                    discard(stack, 3);
+                    clean = false;
+                    break;
+
+                case CALL_FUNC:
+                case TAIL_CALL:
+                    discard(stack, a + 1);
+                    stack.push_back(opaque());
+                    clean = false;
+                    break;
+
+                case RESUME:
+                    discard(stack, 1);
+                    stack.push_back(opaque());
+                    clean = false;
+                    break;
+
+                case ITER_NEXT:
+                    stack.push_back(opaque());
+                    clean = false;
+                    break;
+
+                default:
+                    // Jumps, returns and anything unexpected end the block.
+                    for (auto &e : stack) {
+                        collect(e);
+                        e = opaque();
+                    }
+                    clean = false;
+                    break;
+            }
+        }
+
+        for (auto &e : stack)
+            collect(e);
+    }
+};
+
+int hoistInvariants(VM *vm, std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                    int start, int condition, int &varOffset, const std::set<int> &captured) {
+    LoopHoister hoister(vm, code, constants);
+    hoister.scan(start);
+
+    // A hoisted value could be deleted by one iteration and used by the next.
+    if (hoister.deletes)
+        return 0;
+
+    hoister.run(condition, captured);
+
+    auto &hoisted = hoister.hoisted;
+    std::sort(hoisted.begin(), hoisted.end());
+
+    while (!hoisted.empty() && varOffset + hoisted.size() > 256)
+        hoisted.pop_back();
+
+    if (hoisted.empty())
+        return 0;
+
+    std::vector<int> &pcs = hoister.pcs;
+    int end = code.size();
+    pcs.push_back(end);
+
+    // Each hoisted expression is computed once into a new local before the
+    // loop, and read from that local where it used to be.
+    std::vector<uint8_t> preheader;
+    std::map<int, std::pair<int, int> > replaced;
+
+    for (auto &range : hoisted) {
+        int slot = varOffset++;
+
+        preheader.insert(preheader.end(), code.begin() + pcs[range.first],
+                         code.begin() + pcs[range.second + 1]);
+        preheader.push_back(MEMSET);
+        preheader.push_back(slot);
+
+        replaced[range.first] = {range.second, slot};
+    }
+
+    // New position of every old instruction in the loop.
+    std::map<int, int> moved;
+    int header = start + preheader.size();
+    int position = header;
+
+    for (int i = 0; i < pcs.size() - 1; i++) {
+        moved[pcs[i]] = position;
+
+        auto range = replaced.find(i);
+        if (range != replaced.end()) {
+            position += 2;
+            i = range->second.first;
+        } else {
+            position += instructionLength(code[pcs[i]]);
+        }
+    }
+    moved[end] = position;
+
+    std::vector<uint8_t> loop;
+
+    for (int i = 0; i < pcs.size() - 1; i++) {
+        int pc = pcs[i];
+        uint8_t op = code[pc];
+        int at = header + loop.size();
+
+        auto range = replaced.find(i);
+        if (range != replaced.end()) {
+            loop.push_back(MEM);
+            loop.push_back(range->second.second);
+            i = range->second.first;
+            continue;
+        }
+
+        switch (op) {
+            case JUMP:
+            case JEQ:
+                loop.push_back(op);
+                loop.push_back(moved[pc + 1 + code[pc + 1]] - (at + 1));
+                break;
+
+            case JUMP_BACK:
+                loop.push_back(op);
+                loop.push_back((at + 1) - moved[pc + 1 - code[pc + 1]]);
+                break;
+
+            case ITER_NEXT:
+                loop.push_back(op);
+                loop.push_back(code[pc + 1]);
+                loop.push_back(moved[pc + 2 + code[pc + 2]] - (at + 2));
+                break;
+
+            default:
+                loop.insert(loop.end(), code.begin() + pc, code.begin() + pc + instructionLength(op));
+                break;
+        }
+    }
+
+    code.resize(start);
+    code.insert(code.end(), preheader.begin(), preheader.end());
+    code.insert(code.end(), loop.begin(), loop.end());
+
+    return hoisted.size();
+}
@@ -1,35 +1,54 @@
+#include <stdlib.h>
+
 #include <string>
 #include <fstream>
 #include <streambuf>
 #include <iostream>
+#include <chrono>
 
 #include "value.hpp"
+#include "pool.hpp"
+
+int instructionLength(uint8_t op) {
+    switch (op) {
+        case ITER_NEXT:
+        case CALL:
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case LT:
+        case GT:
+        case LTEQ:
+        case GTEQ:
+            return 3;
+
+        case MOVB:
+        case JUMP:
+        case JUMP_BACK:
+        case JEQ:
+        case ITER_INIT:
+        case NEW_LIST:
+        case MEM:
+        case MEMSET:
+        case GLOBAL:
+        case GET_UPVAL:
+        case SET_UPVAL:
+        case CLOSURE:
+        case CALL_FUNC:
+        case TAIL_CALL:
+            return 2;
+
+        default:
+            return 1;
+    }
+}
 
-enum Instruction {
-    MOVB,
-
-    JUMP,
-    JUMP_BACK,
-    JEQ,
-
-    MEM,
-    MEMSET,
-
-    POP,
-
-    ADD,
-    SUB,
-    MUL,
-
-    CALL,
-    CALL_FUNC,
-
-    DEL,
-
-    RETURN,
-};
+// Largest function body, in bytes, that is copied into its call sites.
+static const int INLINE_BUDGET = 32;
 
-std::map<TokenType, std::string> TYPE_TO_STRING = {
+// Shared by every VM on every thread, so only ever read.
+static const std::map<TokenType, std::string> TYPE_TO_STRING = {
     {TOKEN_NUMBER, "TOKEN_NUMBER"},
     {TOKEN_STRING, "TOKEN_STRING"},
     {TOKEN_IDENT, "TOKEN_IDENT"},
@@ -61,6 +80,8 @@ std::map<TokenType, std::string> TYPE_TO_STRING = {
     {TOKEN_ELSE, "TOKEN_ELSE"},
 
     {TOKEN_WHILE, "TOKEN_WHILE"},
+    {TOKEN_FOR, "TOKEN_FOR"},
+    {TOKEN_IN, "TOKEN_IN"},
 
     {TOKEN_FUNCTION, "TOKEN_FUNCTION"},
     {TOKEN_CLASS, "TOKEN_CLASS"},
@@ -70,9 +91,12 @@ std::map<TokenType, std::string> TYPE_TO_STRING = {
 
     {TOKEN_EMPTY, "TOKEN_EMPTY"},
     {TOKEN_RETURN, "TOKEN_RETURN"},
+
+    {TOKEN_YIELD, "TOKEN_YIELD"},
+    {TOKEN_RESUME, "TOKEN_RESUME"},
 };
 
-std::map<char, TokenType> SINGLE_CHAR_TOKENS = {
+static const std::map<char, TokenType> SINGLE_CHAR_TOKENS = {
     {'+', TOKEN_ADD},
     {'-', TOKEN_SUB},
     {'*', TOKEN_MUL},
@@ -95,10 +119,12 @@ std::map<char, TokenType> SINGLE_CHAR_TOKENS = {
     {'\n', TOKEN_LINE},
 };
 
-std::map<std::string, TokenType> KEYWORDS = {
+static const std::map<std::string, TokenType> KEYWORDS = {
     {"if", TOKEN_IF},
     {"else", TOKEN_ELSE},
     {"while", TOKEN_WHILE},
+    {"for", TOKEN_FOR},
+    {"in", TOKEN_IN},
 
     {"function", TOKEN_FUNCTION},
     {"class", TOKEN_CLASS},
@@ -109,15 +135,31 @@ std::map<std::string, TokenType> KEYWORDS = {
     {"delete", TOKEN_DELETE},
 
     {"return", TOKEN_RETURN},
+
+    {"yield", TOKEN_YIELD},
+    {"resume", TOKEN_RESUME},
 };
 
+static std::string tokenName(TokenType type) {
+    auto name = TYPE_TO_STRING.find(type);
+    return name != TYPE_TO_STRING.end() ? name->second : "";
+}
+
+void Output::flush() {
+    if (buffer.empty())
+        return;
+
+    fwrite(buffer.data(), 1, buffer.size(), stdout);
+    fflush(stdout);
+    buffer.clear();
+}
+
 void error(std::string err) {
     std::cout << "Error: " << err << std::endl;
 }
 
 void abort(std::string err) {
-    error(err);
-    exit(0);
+    throw ScriptError{err};
 }
 
 void expected(std::string expect) {
@@ -276,8 +318,10 @@ public:
         } else if (isAlpha(lookAhead)) {
             std::string name = getName();
 
-            if (KEYWORDS.find(name) != KEYWORDS.end()) {
-                add(KEYWORDS[name]);
+            auto keyword = KEYWORDS.find(name);
+
+            if (keyword != KEYWORDS.end()) {
+                add(keyword->second);
 
                 if (name == "function") {
                     skipWhite();
@@ -306,8 +350,8 @@ public:
                 twoChar(">=", TOKEN_GTEQ, TOKEN_GT);
             } else if (lookAhead == '=') {
                 twoChar("==", TOKEN_EQEQ, TOKEN_EQ);
-            } else if (SINGLE_CHAR_TOKENS.find(lookAhead) != SINGLE_CHAR_TOKENS.end()) {
-                add(SINGLE_CHAR_TOKENS[lookAhead]);
+            } else if (SINGLE_CHAR_TOKENS.count(lookAhead)) {
+                add(SINGLE_CHAR_TOKENS.at(lookAhead));
 
                 getChar();
                 skipWhite();
@@ -344,7 +388,7 @@ void Compiler::match(TokenType type) {
     if (type == current.type)  {
         consume();
     } else {
-        expected("Got " + TYPE_TO_STRING[current.type] + ", type " + TYPE_TO_STRING[type]);
+        expected("Got " + tokenName(current.type) + ", type " + tokenName(type));
     }
 }
 
@@ -375,6 +419,70 @@ bool Compiler::isRelop(TokenType type) {
            type == TOKEN_EQ;
 }
 
+// A statement with jumps in it. Inlining can make one too long for its
+// one-byte offsets even when the calls themselves fit, so if it does the
+// statement is compiled again from the same tokens with inlining off.
+void Compiler::branchStatement() {
+    int codeSize = code.size();
+    int constantCount = constants.size();
+    int start = it;
+    Token first = current;
+    Token second = next;
+    int locals = varOffset;
+    int call = lastCall;
+    std::map<std::string, int> oldVars = vars;
+    std::map<int, Function *> oldFunctionVars = functionVars;
+    std::set<int> oldCaptured = captured;
+    std::vector<UpvalueInfo> oldUpvalues = upvalues;
+
+    bool outer = overflowed;
+    int inlinedBefore = inlinedCalls;
+    bool retried = false;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        overflowed = false;
+
+        if (current.type == TOKEN_IF) {
+            ifBlock();
+        } else if (current.type == TOKEN_WHILE) {
+            whileBlock();
+        } else {
+            forBlock();
+        }
+
+        if (!overflowed || inlinedCalls == inlinedBefore || noInline > 0)
+            break;
+
+        code.resize(codeSize);
+        constants.resize(constantCount);
+        it = start;
+        current = first;
+        next = second;
+        varOffset = locals;
+        lastCall = call;
+        vars = oldVars;
+        functionVars = oldFunctionVars;
+        captured = oldCaptured;
+        upvalues = oldUpvalues;
+        inlinedCalls = inlinedBefore;
+
+        noInline++;
+        retried = true;
+    }
+
+    if (retried)
+        noInline--;
+
+    overflowed = overflowed || outer;
+}
+
+uint8_t Compiler::jumpOffset(int distance) {
+    if (distance > 255)
+        overflowed = true;
+
+    return distance;
+}
+
 void Compiler::ifBlock() {
     match(TOKEN_IF);
     match(TOKEN_LPAREN);
@@ -394,7 +502,7 @@ void Compiler::ifBlock() {
         int elseStart = code.size();
         code.push_back(0);
 
-        code[start] = code.size() - start;
+        code[start] = jumpOffset(code.size() - start);
 
         if (current.type == TOKEN_IF) {
             ifBlock();
@@ -402,9 +510,9 @@ void Compiler::ifBlock() {
             block();
         }
 
-        code[elseStart] = code.size() - elseStart;
+        code[elseStart] = jumpOffset(code.size() - elseStart);
     } else {
-        code[start] = code.size() - start;
+        code[start] = jumpOffset(code.size() - start);
     }
 }
 
@@ -423,50 +531,100 @@ void Compiler::whileBlock() {
     block();
 
     code.push_back(JUMP_BACK);
-    code.push_back(code.size() - ifStart);
+    code.push_back(jumpOffset(code.size() - ifStart));
+
+    code[start] = jumpOffset(code.size() - start);
+
+    // Hoisting moves code around, so an earlier call can't become a tail call.
+    if (hoistInvariants(vm, code, constants, ifStart, start - 1, varOffset, captured) > 0)
+        lastCall = -1;
+}
+
+void Compiler::forBlock() {
+    match(TOKEN_FOR);
+    match(TOKEN_LPAREN);
+
+    std::string name = current.value;
+    match(TOKEN_IDENT);
+    match(TOKEN_IN);
+
+    expression();
+    match(TOKEN_RPAREN);
+
+    // Two hidden locals hold the list being walked and the next index.
+    int iterator = varOffset;
+    varOffset += 2;
+
+    code.push_back(ITER_INIT);
+    code.push_back(iterator);
+
+    int loopStart = code.size();
+
+    code.push_back(ITER_NEXT);
+    code.push_back(iterator);
+    int exit = code.size();
+    code.push_back(0);
+
+    setVar(name);
+    block();
+
+    code.push_back(JUMP_BACK);
+    code.push_back(jumpOffset(code.size() - loopStart));
 
-    code[start] = code.size() - start;
+    code[exit] = jumpOffset(code.size() - exit);
 }
 
 void Compiler::statement() {
-    if (current.type == TOKEN_IF) {
-        ifBlock();
-    } else if (current.type == TOKEN_WHILE) {
-        whileBlock();
+    if (current.type == TOKEN_IF || current.type == TOKEN_WHILE || current.type == TOKEN_FOR) {
+        branchStatement();
     } else if (next.type == TOKEN_EQ) {
         assignment();
+    } else if (isIndexAssignment()) {
+        indexAssignment();
     } else if (current.type == TOKEN_DELETE) {
         deleteStatement();
     } else if (current.type == TOKEN_LINE) {
         consume();
     } else if (current.type == TOKEN_RETURN) {
         returnStatement();
+    } else if (current.type == TOKEN_YIELD) {
+        yieldStatement();
     } else if (current.type == TOKEN_CLASS) {
         classStatement();
     } else if (current.type == TOKEN_FUNCTION) {
         createFunction();
     } else {
         expression();
+        code.push_back(POP);
     }
 }
 
 void Compiler::arguments() {
     match(TOKEN_LPAREN);
 
-    if (current.type == TOKEN_RPAREN) {
+    std::vector<std::string> names;
+
+    if (current.type != TOKEN_RPAREN) {
+        names.push_back(current.value);
         consume();
-        return;
     }
 
-    setVar(current.value);
-    consume();
-
     while (current.type != TOKEN_RPAREN) {
         match(TOKEN_COMMA);
-        setVar(current.value);
+        names.push_back(current.value);
         consume();
     }
     consume();
+
+    // Arguments are pushed in order, so the last one is on top of the stack.
+    for (auto &name : names) {
+        vars[name] = varOffset++;
+    }
+    arity = names.size();
+
+    for (int i = names.size() - 1; i >= 0; i--) {
+        setVar(names[i]);
+    }
 }
 
 void Compiler::createFunction() {
@@ -478,30 +636,48 @@ void Compiler::createFunction() {
         match(TOKEN_IDENT);
     }
 
-    auto temp = code;
     Value func = newFunction(vm);
 
+    int load = code.size();
     code.push_back(MOVB);
     code.push_back(constants.size());
     constants.push_back(func);
 
+    // Declared before the body is compiled so the function can call itself.
+    if (fnName != "") {
+        setVar(fnName);
+    }
+
     Compiler fnCompiler(vm, this);
 
     fnCompiler.arguments();
     fnCompiler.block();
     fnCompiler.code.push_back(MOVB);
-    fnCompiler.code.push_back(constants.size());
-    fnCompiler.constants.push_back(newNum(0));
+    fnCompiler.code.push_back(fnCompiler.constants.size());
+    fnCompiler.constants.push_back(newInt(0));
     fnCompiler.code.push_back(RETURN);
 
-    if (fnName != "") {
-        setVar(fnName);
-    }
+    vm->specialized += specializeNumeric(vm, fnCompiler.code, fnCompiler.constants,
+                                         fnCompiler.varOffset, fnCompiler.captured,
+                                         &vm->specializable);
 
     Function *fn = AS(func, Function);
     fn->code = std::vector<uint8_t>(fnCompiler.code);
     fn->constants = fnCompiler.constants;
     fn->localCount = fnCompiler.varOffset;
+    fn->arity = fnCompiler.arity;
+    fn->upvalues = fnCompiler.upvalues;
+
+    verifyFunction(vm, fn);
+
+    // Only functions that capture something need a closure object.
+    if (!fn->upvalues.empty()) {
+        code[load] = CLOSURE;
+    }
+
+    if (fnName != "" && findVar(fnName) != -1) {
+        functionVars[findVar(fnName)] = fn;
+    }
 
     it = fnCompiler.it;
     current = fnCompiler.current;
@@ -509,6 +685,11 @@ void Compiler::createFunction() {
 }
 
 uint8_t Compiler::findSymbol(std::string symbol) {
+    int core = findCoreSymbol(symbol);
+    if (core != -1) {
+        return core;
+    }
+
     auto &table = vm->compiler->symbolsTable;
 
     auto it = table.find(symbol);
@@ -516,24 +697,21 @@ uint8_t Compiler::findSymbol(std::string symbol) {
     if (it != table.end()) {
         return it->second;
     } else {
-        int size = table.size();
-        table[symbol] = size;
-        return size;
+        int id = CORE_SYMBOLS + table.size();
+        table[symbol] = id;
+        return id;
     }
 }
 
 void Compiler::function() {
     bool method = current.value == "";
 
-    if (!method) {
-        code.push_back(MEM);
-
-        int var = findVar(current.value);
-        if (var == -1) {
-            abort(current.value + " used before init.");
-        }
+    Function *inlined = nullptr;
+    int callStart = code.size();
 
-        code.push_back(var);
+    if (!method) {
+        inlined = inlineCandidate(current.value);
+        getVar(current.value);
     }
 
     match(TOKEN_SYMBOL_START);
@@ -547,11 +725,18 @@ void Compiler::function() {
         depth++;
     }
 
-    if (method) {
+    if (inlined != nullptr && inlined->arity == depth && canInline(inlined)) {
+        // The arguments stay on the stack for the body's own parameter
+        // stores; only the load of the function itself goes away.
+        code.erase(code.begin() + callStart, code.begin() + callStart + 2);
+        inlineFunction(inlined);
+        inlinedCalls++;
+    } else if (method) {
         code.push_back(CALL);
         code.push_back(findSymbol(current.value));
         code.push_back(depth);
     } else {
+        lastCall = code.size();
         code.push_back(CALL_FUNC);
         code.push_back(depth);
     }
@@ -559,6 +744,140 @@ void Compiler::function() {
     match(TOKEN_SYMBOL);
 }
 
+Function *Compiler::inlineCandidate(std::string name) {
+    if (!vm->inlining || noInline > 0) {
+        return nullptr;
+    }
+
+    // A name that isn't local here is either a global or a variable of an
+    // enclosing function, captured as an upvalue. Only globals are known.
+    Compiler *scope = this;
+    if (findVar(name) == -1) {
+        while (scope->parent != nullptr) {
+            scope = scope->parent;
+
+            if (scope->parent != nullptr && scope->findVar(name) != -1) {
+                return nullptr;
+            }
+        }
+    }
+
+    int var = scope->findVar(name);
+    auto result = scope->functionVars.find(var);
+    if (var == -1 || result == scope->functionVars.end()) {
+        return nullptr;
+    }
+
+    // Only a name bound once in the whole program is known to still hold
+    // this function wherever it is called.
+    int bindings = 0;
+    for (int i = 0; i < input.size(); i++) {
+        if (input[i].type == TOKEN_IDENT && input[i].value == name) {
+            bool declared = (i > 0 && input[i - 1].type == TOKEN_FUNCTION) ||
+                            (i > 1 && input[i - 2].type == TOKEN_FOR);
+            bool assigned = i + 1 < input.size() && input[i + 1].type == TOKEN_EQ;
+
+            if (declared || assigned) {
+                bindings++;
+            }
+        }
+    }
+
+    return bindings == 1 ? result->second : nullptr;
+}
+
+// The body that gets copied: everything up to the function's last RETURN,
+// minus the implicit "return 0" when an explicit return precedes it.
+static int inlineEnd(Function *fn) {
+    std::vector<int> starts;
+    for (int pc = 0; pc < fn->code.size(); pc += instructionLength(fn->code[pc])) {
+        starts.push_back(pc);
+    }
+
+    int n = starts.size();
+    if (n >= 3 && fn->code[starts[n - 3]] == RETURN) {
+        return starts[n - 3];
+    }
+
+    return starts[n - 1];
+}
+
+bool Compiler::canInline(Function *fn) {
+    if (fn->foreign) {
+        return false;
+    }
+
+    int end = inlineEnd(fn);
+    if (end > INLINE_BUDGET) {
+        return false;
+    }
+
+    int newConstants = 0;
+    for (int pc = 0; pc < end; pc += instructionLength(fn->code[pc])) {
+        uint8_t op = fn->code[pc];
+
+        if (op == RETURN || op == CALL_FUNC || op == TAIL_CALL ||
+            op == CLOSURE || op == GET_UPVAL || op == SET_UPVAL) {
+            return false;
+        }
+
+        int target = -1;
+        if (op == JUMP || op == JEQ) {
+            target = pc + 1 + fn->code[pc + 1];
+        } else if (op == ITER_NEXT) {
+            target = pc + 2 + fn->code[pc + 2];
+        }
+
+        if (target > end) {
+            return false;
+        }
+
+        if (op == MOVB) {
+            newConstants++;
+        }
+    }
+
+    return constants.size() + newConstants <= 256 &&
+           varOffset + fn->localCount <= 256;
+}
+
+void Compiler::inlineFunction(Function *fn) {
+    int end = inlineEnd(fn);
+
+    // The callee's locals become fresh locals of this function.
+    int base = varOffset;
+    varOffset += fn->localCount;
+
+    for (int pc = 0; pc < end; pc += instructionLength(fn->code[pc])) {
+        uint8_t op = fn->code[pc];
+        code.push_back(op);
+
+        switch (op) {
+            case MOVB:
+                code.push_back(constants.size());
+                constants.push_back(fn->constants[fn->code[pc + 1]]);
+                break;
+
+            case MEM:
+            case MEMSET:
+            case ITER_INIT:
+                code.push_back(fn->code[pc + 1] + base);
+                break;
+
+            case ITER_NEXT:
+                code.push_back(fn->code[pc + 1] + base);
+                code.push_back(fn->code[pc + 2]);
+                break;
+
+            default:
+                for (int i = 1; i < instructionLength(op); i++) {
+                    code.push_back(fn->code[pc + i]);
+                }
+                break;
+        }
+    }
+}
+
 void Compiler::block() {
     match(TOKEN_LCURLY);
     while (current.type != TOKEN_RCURLY) {
@@ -571,7 +890,7 @@ void Compiler::expression() {
     if (isAddop(current.type)) {
         code.push_back(MOVB);
         code.push_back(constants.size());
-        constants.push_back(newNum(0));
+        constants.push_back(newInt(0));
     } else {
         term();
     }
@@ -607,7 +926,12 @@ int Compiler::findVar(std::string name) {
         // if (parent != nullptr) {
         //     return parent->findVar(name);
         // }
-        
+
+        // Top-level code also sees the core globals, in their fixed slots.
+        if (parent == nullptr) {
+            return findCoreGlobal(name);
+        }
+
         return -1;
     }
 
@@ -624,8 +948,129 @@ void Compiler::assignment() {
     setVar(name);
 }
 
+bool Compiler::isIndexAssignment() {
+    if (current.type != TOKEN_IDENT || next.type != TOKEN_LBRACKET)
+        return false;
+
+    // Skip over every [...] group after the name and look for an '='.
+    int i = it;
+    while (i < input.size() && input[i].type == TOKEN_LBRACKET) {
+        int depth = 0;
+
+        do {
+            if (input[i].type == TOKEN_LBRACKET) depth++;
+            else if (input[i].type == TOKEN_RBRACKET) depth--;
+            i++;
+        } while (i < input.size() && depth > 0);
+    }
+
+    return i < input.size() && input[i].type == TOKEN_EQ;
+}
+
+void Compiler::indexAssignment() {
+    getVar(current.value);
+    consume();
+
+    while (true) {
+        match(TOKEN_LBRACKET);
+        expression();
+        match(TOKEN_RBRACKET);
+
+        if (current.type != TOKEN_LBRACKET)
+            break;
+
+        code.push_back(INDEX_GET);
+    }
+
+    match(TOKEN_EQ);
+    expression();
+
+    code.push_back(INDEX_SET);
+}
+
+int Compiler::findGlobal(std::string name) {
+    Compiler *root = this;
+    while (root->parent != nullptr) {
+        root = root->parent;
+    }
+
+    if (root == this) {
+        return -1;
+    }
+
+    return root->findVar(name);
+}
+
+void Compiler::getVar(std::string name) {
+    int var = findVar(name);
+    if (var != -1) {
+        code.push_back(MEM);
+        code.push_back(var);
+        return;
+    }
+
+    var = findUpvalue(name);
+    if (var != -1) {
+        code.push_back(GET_UPVAL);
+        code.push_back(var);
+        return;
+    }
+
+    var = findGlobal(name);
+    if (var != -1) {
+        code.push_back(GLOBAL);
+        code.push_back(var);
+        return;
+    }
+
+    abort(name + " used before init.");
+}
+
+int Compiler::findUpvalue(std::string name) {
+    // Top-level variables are globals and are never captured.
+    if (parent == nullptr || parent->parent == nullptr) {
+        return -1;
+    }
+
+    int local = parent->findVar(name);
+    if (local != -1) {
+        parent->captured.insert(local);
+        return addUpvalue(true, local);
+    }
+
+    int upvalue = parent->findUpvalue(name);
+    if (upvalue != -1) {
+        return addUpvalue(false, upvalue);
+    }
+
+    return -1;
+}
+
+int Compiler::addUpvalue(bool isLocal, int index) {
+    for (int i = 0; i < upvalues.size(); i++) {
+        if (upvalues[i].isLocal == isLocal && upvalues[i].index == index) {
+            return i;
+        }
+    }
+
+    upvalues.push_back({isLocal, index});
+    return upvalues.size() - 1;
+}
+
 void Compiler::setVar(std::string name) {
     int var = findVar(name);
+
+    // Assigning to a variable of an enclosing function writes through to it;
+    // top-level variables are still shadowed by a new local.
+    if (var == -1) {
+        int upvalue = findUpvalue(name);
+        if (upvalue != -1) {
+            code.push_back(SET_UPVAL);
+            code.push_back(upvalue);
+            return;
+        }
+    }
+
     if (var == -1) {
         var = varOffset;
         vars[name] = var;
@@ -650,18 +1095,37 @@ void Compiler::returnStatement() {
     if (current.type == TOKEN_LINE) {
         code.push_back(MOVB);
         code.push_back(constants.size());
-        constants.push_back(newNum(0));
+        constants.push_back(newInt(0));
     } else {
         expression();
     }
 
+    // A call that is the whole return value reuses this function's frame.
+    if (parent != nullptr && lastCall == (int)code.size() - 2) {
+        code[lastCall] = TAIL_CALL;
+    }
+
     code.push_back(RETURN);
 }
 
+void Compiler::yieldStatement() {
+    match(TOKEN_YIELD);
+
+    if (current.type == TOKEN_LINE) {
+        code.push_back(MOVB);
+        code.push_back(constants.size());
+        constants.push_back(newInt(0));
+    } else {
+        expression();
+    }
+
+    code.push_back(YIELD);
+}
+
 void Compiler::classStatement() {
     match(TOKEN_CLASS);
 
-    fnName = current.value;
+    std::string className = current.value;
     match(TOKEN_IDENT);
 }
 
@@ -689,31 +1153,30 @@ void Compiler::factor() {
         expression();
         match(TOKEN_RPAREN);
     } else if (current.type == TOKEN_IDENT) {
-        code.push_back(MEM);
-
-        int var = findVar(current.value);
-        if (var == -1) {
-            abort(current.value + " used before init.");
-        }
-
-        code.push_back(var);
+        getVar(current.value);
         consume();
     } else if (current.type == TOKEN_TRUE) {
         code.push_back(MOVB);
         code.push_back(constants.size());
-        constants.push_back(newNum(1));
+        constants.push_back(newInt(1));
 
         consume();
     } else if (current.type == TOKEN_FALSE) {
         code.push_back(MOVB);
         code.push_back(constants.size());
-        constants.push_back(newNum(0));
+        constants.push_back(newInt(0));
 
         consume();
     } else if (current.type == TOKEN_NUMBER) {
         code.push_back(MOVB);
         code.push_back(constants.size());
-        constants.push_back(newNum(std::stof(current.value)));
+        double number = strtod(current.value.c_str(), nullptr);
+
+        if (current.value.find('.') == std::string::npos && number <= MAX_INT) {
+            constants.push_back(newInt(number));
+        } else {
+            constants.push_back(newNum(number));
+        }
 
         consume();
     } else if (current.type == TOKEN_STRING) {
@@ -725,25 +1188,61 @@ void Compiler::factor() {
     } else if (current.type == TOKEN_LBRACKET) {
         consume();
 
-        code.push_back(MOVB);
-        code.push_back(constants.size());
-        constants.push_back(newList(vm));
+        int count = 0;
+        while (current.type != TOKEN_RBRACKET) {
+            if (current.type == TOKEN_LINE) {
+                consume();
+                continue;
+            }
+
+            expression();
+            count++;
+
+            if (current.type == TOKEN_COMMA) {
+                match(TOKEN_COMMA);
+            }
+        }
+
+        if (count > 255) {
+            abort("Too many elements in list literal.");
+        }
+
+        code.push_back(NEW_LIST);
+        code.push_back(count);
 
         match(TOKEN_RBRACKET);
     } else if (current.type == TOKEN_SYMBOL_START) {
         function();
-        return;
     } else if (current.type == TOKEN_FUNCTION) {
         createFunction();
+    } else if (current.type == TOKEN_RESUME) {
+        consume();
+        match(TOKEN_LPAREN);
+        expression();
+        match(TOKEN_RPAREN);
+
+        code.push_back(RESUME);
     } else {
-        abort("Unexpected token " + TYPE_TO_STRING[current.type] + ".");
+        abort("Unexpected token " + tokenName(current.type) + ".");
     }
 
-    if (current.type == TOKEN_SYMBOL_START) {
-        function();
+    while (current.type == TOKEN_LBRACKET ||
+           (current.type == TOKEN_SYMBOL_START && current.value == "")) {
+        if (current.type == TOKEN_LBRACKET)
+            index();
+        else
+            function();
     }
 }
 
+void Compiler::index() {
+    match(TOKEN_LBRACKET);
+    expression();
+    match(TOKEN_RBRACKET);
+
+    code.push_back(INDEX_GET);
+}
+
 void Compiler::mul() {
     match(TOKEN_MUL);
     factor();
@@ -768,6 +1267,11 @@ Compiler::Compiler(VM *vm, Compiler *parent) :
     it(0),
     current(TOKEN_EMPTY),
     next(TOKEN_EMPTY),
+    lastCall(-1),
+    arity(0),
+    overflowed(false),
+    inlinedCalls(0),
+    noInline(0),
     varOffset(0)
 {
     code = std::vector<uint8_t>();
@@ -788,38 +1292,54 @@ std::vector<uint8_t> Compiler::compile(std::vector<Token> in) {
     input = in;
     it = 0;
 
+    // Variables from earlier runs may hold anything.
+    std::set<int> earlier;
+    for (int i = 0; i < varOffset; i++) {
+        earlier.insert(i);
+    }
+
     consume();
     while (it <= input.size()) {
         statement();
     }
     code.push_back(RETURN);
 
+    vm->specialized += specializeNumeric(vm, code, constants, varOffset, earlier,
+                                         &vm->specializable);
+
+    std::string error;
+    if (!verifyCode(vm, code, constants, varOffset, 0, 0, false, &error))
+        abort("Invalid bytecode: " + error);
+
     return code;
 }
 
 VM::VM() {
     memoryOffset = 0;
+    closure = nullptr;
+    function = nullptr;
+    coroutine = nullptr;
+    pending = false;
+    budget = INT64_MAX;
+    sliced = false;
+    preempted = false;
+    callbacks = 0;
+    nativeDepth = 0;
+    inlining = true;
+    jit = false;
+    jitThreshold = 1000;
+    specialized = 0;
+    specializable = 0;
+    workers = 0;
+    argCount = 0;
 
-    numClass = new ObjectClass();
-    strClass = new ObjectClass();
-    listClass = new ObjectClass();
-    functionClass = new ObjectClass();
+    initCore(*this);
 
     compiler = new Compiler(this, nullptr);
-
-    run(
-        "function print() {}"
-    );
-
-    initCore(*this);
+    compiler->varOffset = memory.size();
 }
 
 VM::~VM() {
-    delete numClass;
-    delete strClass;
-    delete listClass;
-    delete functionClass;
-
     delete compiler;
 }
 
@@ -833,27 +1353,76 @@ void VM::push(Value val) {
     stack.push_back(val);
 }
 
-std::string valueToStr(VM *vm, Value v) {
-    if (!v.isObject) return std::to_string(v.as.num);
+void writeValue(VM *vm, std::string &out, Value v) {
+    if (!v.isObject) {
+        writeNum(out, asNum(v));
+        return;
+    }
 
-    if (v.as.object->classObject == vm->listClass) {
-        std::string final = "[";
-        
+    ObjectClass *classObject = v.as.object->classObject;
+
+    if (classObject == vm->listClass) {
         List *list = AS(v, List);
 
+        out += '[';
+
         for (int i = 0; i < list->size; i++) {
-            final += valueToStr(vm, list->items[i]);
+            if (i != 0)
+                out += ", ";
 
-            if (i != list->size - 1)
-                final += ", ";
+            writeValue(vm, out, list->items[i]);
         }
 
-        return final + "]";
-    } else if (v.as.object->classObject == vm->functionClass) {
-        return "function";
+        out += ']';
+    } else if (classObject == vm->float64ArrayClass) {
+        Float64Array *array = AS(v, Float64Array);
+
+        out += '[';
+
+        for (int i = 0; i < array->size; i++) {
+            if (i != 0)
+                out += ", ";
+
+            writeNum(out, array->items[i]);
+        }
+
+        out += ']';
+    } else if (classObject == vm->functionClass || classObject == vm->closureClass) {
+        out += "function";
+    } else if (classObject == vm->coroutineClass) {
+        out += "coroutine";
+    } else if (classObject == vm->sequenceClass) {
+        out += "sequence";
+    } else if (classObject == vm->fileClass) {
+        out += "file";
+    } else if (classObject == vm->stringViewClass) {
+        out.append(AS(v, StringView)->data, AS(v, StringView)->size);
+    } else if (classObject == vm->mapClass) {
+        Map *map = AS(v, Map);
+
+        out += '{';
+
+        for (int i = 0; i < map->entries.size(); i++) {
+            if (i != 0)
+                out += ", ";
+
+            out += map->entries[i].key->value;
+            out += ": ";
+            writeValue(vm, out, map->entries[i].value);
+        }
+
+        out += '}';
+    } else if (classObject == vm->jsonClass) {
+        out += "json";
+    } else {
+        out += AS(v, String)->value;
     }
+}
 
-    return AS(v, String)->value;
+std::string valueToStr(VM *vm, Value v) {
+    std::string out;
+    writeValue(vm, out, v);
+    return out;
 }
 
 void VM::printStack() {
@@ -862,19 +1431,102 @@ void VM::printStack() {
     }
 }
 
-void VM::run(std::string code) {
+// Compiles top-level code without running it; new globals get their slots.
+std::vector<uint8_t> VM::compile(std::string code) {
     Tokenizer tz(code);
     auto tokens = tz.tokenize();
 
     auto instructions = compiler->compile(tokens);
-    ip = &instructions.front();
-    constants = compiler->constants;
-    uint8_t dif = 0;
 
     for (int i=memory.size(); i<compiler->varOffset; i++) {
         memory.push_back({});
     }
 
+    return instructions;
+}
+
+bool VM::run(std::string code, std::string *error) {
+    return load(code, error) && runFor(0, error) == FINISHED;
+}
+
+bool VM::load(std::string code, std::string *error) {
+    try {
+        program = compile(code);
+    } catch (ScriptError &e) {
+        if (error != nullptr)
+            *error = e.message;
+        return false;
+    }
+
+    ip = &program.front();
+    constants = compiler->constants.data();
+    pending = true;
+    return true;
+}
+
+VM::Status VM::runFor(int64_t slice, std::string *error) {
+    if (!pending)
+        return FINISHED;
+
+    budget = slice > 0 ? slice : INT64_MAX;
+    sliced = slice > 0;
+    preempted = false;
+
+    try {
+        execute(0);
+    } catch (ScriptError &e) {
+        output.flush();
+        unwind(compiler->varOffset);
+        pending = false;
+
+        if (error != nullptr)
+            *error = e.message;
+        return FAILED;
+    }
+
+    output.flush();
+
+    if (preempted)
+        return PREEMPTED;
+
+    pending = false;
+    return FINISHED;
+}
+
+// Counts a back-edge or call against the budget. Only the outermost execute
+// can stop, since everything it is running lives in the VM.
+inline bool VM::outOfBudget(int exitDepth) {
+    if (--budget > 0 || exitDepth != 0)
+        return false;
+
+    preempted = true;
+    return true;
+}
+
+// Drops the frames and temporaries an error left behind, back to top level.
+void VM::unwind(int globals) {
+    if (!openUpvalues.empty())
+        closeUpvalues(globals);
+
+    memory.resize(globals);
+    stack.clear();
+    frames.clear();
+
+    memoryOffset = 0;
+    closure = nullptr;
+    function = nullptr;
+    callbacks = 0;
+    nativeDepth = 0;
+
+    for (; coroutine != nullptr; coroutine = coroutine->resumer)
+        coroutine->state = Coroutine::DONE;
+}
+
+// Interprets from ip until the function whose frame sits at exitDepth
+// returns; 0 runs top-level code to its end.
+void VM::execute(int exitDepth) {
+    uint8_t dif = 0;
+
     while (true) {
         uint8_t c = *ip++;
         switch (c) {
@@ -890,16 +1542,62 @@ void VM::run(std::string code) {
             case JUMP_BACK:
                 dif = *ip;
                 ip -= dif;
+
+                if (outOfBudget(exitDepth))
+                    return;
+
+                // A loop that went native finished the whole call there.
+                // Inside a coroutine everything stays interpreted, as
+                // native code could not yield from anything it calls.
+                if (jit && function != nullptr && coroutine == nullptr && enterLoop() &&
+                    frames.size() < exitDepth)
+                    return;
                 break;
 
-            case JEQ:
-                if (pop().as.num == 0) {
+            case JEQ: {
+                Value condition = pop();
+
+                if (condition.isInt ? condition.as.integer == 0 : condition.as.num == 0) {
                     dif = *ip;
                     ip += dif;
                 } else {
                     ip++;
                 }
                 break;
+            }
+
+            case ITER_INIT:
+                iterInit(*ip++);
+                break;
+
+            case ITER_NEXT:
+                if (iterNext(*ip)) {
+                    ip += 2;
+
+                    // The loop variable takes the element as it is, even a
+                    // view the next pull moves on.
+                    if (*ip == MEMSET) {
+                        memory[*(ip + 1) + memoryOffset] = pop();
+                        ip += 2;
+                    }
+                } else {
+                    ip++;
+                    dif = *ip;
+                    ip += dif;
+                }
+                break;
+
+            case INDEX_GET:
+                indexGet();
+                break;
+
+            case INDEX_SET:
+                indexSet();
+                break;
+
+            case NEW_LIST:
+                buildList(*ip++);
+                break;
 
             case MEM:
                 push(memory[*ip + memoryOffset]);
@@ -907,54 +1605,365 @@ void VM::run(std::string code) {
                 break;
 
             case MEMSET:
-                memory[*ip + memoryOffset] = pop();
+                memory[*ip + memoryOffset] = retain(this, pop());
                 ip++;
                 break;
 
+            case GLOBAL:
+                push(memory[*ip]);
+                ip++;
+                break;
+
+            case GET_UPVAL: {
+                Upvalue *upvalue = closure->upvalues[*ip++];
+                push(upvalue->open ? memory[upvalue->slot] : upvalue->closed);
+                break;
+            }
+
+            case SET_UPVAL: {
+                Upvalue *upvalue = closure->upvalues[*ip++];
+
+                if (upvalue->open)
+                    memory[upvalue->slot] = retain(this, pop());
+                else
+                    upvalue->closed = retain(this, pop());
+                break;
+            }
+
+            case CLOSURE:
+                makeClosure(AS(constants[*ip++], Function));
+                break;
+
             case POP:
                 pop();
                 break;
 
+            case ADD: {
+                Value b = pop();
+                stack.back() = numAdd(stack.back(), b);
+                ip += 2;
+                break;
+            }
+
+            case SUB: {
+                Value b = pop();
+                stack.back() = numSub(stack.back(), b);
+                ip += 2;
+                break;
+            }
+
+            case MUL: {
+                Value b = pop();
+                stack.back() = numMul(stack.back(), b);
+                ip += 2;
+                break;
+            }
+
+            case DIV: {
+                Value b = pop();
+                stack.back() = numDiv(stack.back(), b);
+                ip += 2;
+                break;
+            }
+
+            case LT: {
+                Value b = pop();
+                Value &a = stack.back();
+                a = newInt(a.isInt && b.isInt ? a.as.integer < b.as.integer : asNum(a) < asNum(b));
+                ip += 2;
+                break;
+            }
+
+            case GT: {
+                Value b = pop();
+                Value &a = stack.back();
+                a = newInt(a.isInt && b.isInt ? a.as.integer > b.as.integer : asNum(a) > asNum(b));
+                ip += 2;
+                break;
+            }
+
+            case LTEQ: {
+                Value b = pop();
+                Value &a = stack.back();
+                a = newInt(a.isInt && b.isInt ? a.as.integer <= b.as.integer : asNum(a) <= asNum(b));
+                ip += 2;
+                break;
+            }
+
+            case GTEQ: {
+                Value b = pop();
+                Value &a = stack.back();
+                a = newInt(a.isInt && b.isInt ? a.as.integer >= b.as.integer : asNum(a) >= asNum(b));
+                ip += 2;
+                break;
+            }
+
             case CALL:
                 callMethod(*ip, *(ip + 1));
                 ip += 2;
                 break;
 
-            case CALL_FUNC:
-                callFunction(*ip++);
+            case CALL_FUNC: {
+                Function *fn = callFunction(*ip++);
+
+                if (fn != nullptr && fn->native != nullptr && coroutine == nullptr &&
+                    nativeDepth < MAX_NATIVE_DEPTH) {
+                    nativeDepth++;
+                    fn->native(this);
+                    nativeDepth--;
+                }
+
+                if (outOfBudget(exitDepth))
+                    return;
                 break;
+            }
+
+            case TAIL_CALL: {
+                Function *fn = tailCall(*ip++);
+
+                if (fn != nullptr && fn->native != nullptr && coroutine == nullptr &&
+                    nativeDepth < MAX_NATIVE_DEPTH) {
+                    nativeDepth++;
+                    fn->native(this);
+                    nativeDepth--;
+
+                    if (frames.size() < exitDepth)
+                        return;
+                }
 
-            case DEL:
-                delete pop().as.object;
+                if (outOfBudget(exitDepth))
+                    return;
+                break;
+            }
+
+            case DEL: {
+                Value target = pop();
+                if (target.as.object->classObject != stringViewClass)
+                    delete target.as.object;
+                break;
+            }
+
+            case YIELD:
+                // Outside any coroutine a yield gives up the rest of the slice.
+                if (coroutine == nullptr && sliced && exitDepth == 0) {
+                    pop();
+                    preempted = true;
+                    return;
+                }
+
+                yield(exitDepth);
+                break;
+
+            case RESUME:
+                resume();
                 break;
 
             case RETURN:
-                if (frames.empty())
+                if (frames.size() == exitDepth) {
+                    if (exitDepth > 0)
+                        popFrame();
                     return;
-                else
-                    popFrame();
+                }
+
+                popFrame();
                 break;
         }
     }
 }
 
+// Counts a back-edge of the running function, compiling it once hot, and
+// continues the call in native code from the loop header ip is now at.
+// Returns true if the call was finished there.
+bool VM::enterLoop() {
+    if (function->native == nullptr && ++function->loops == jitThreshold)
+        jitCompile(this, function);
+
+    if (function->native == nullptr || nativeDepth >= MAX_NATIVE_DEPTH)
+        return false;
+
+    auto entry = function->entries.find(ip - &function->code.front());
+    if (entry == function->entries.end())
+        return false;
+
+    nativeDepth++;
+    entry->second(this);
+    nativeDepth--;
+    return true;
+}
+
+void VM::iterInit(int slot) {
+    Value sequence = pop();
+
+    if (!sequence.isObject ||
+        (sequence.as.object->classObject != listClass &&
+         sequence.as.object->classObject != float64ArrayClass &&
+         sequence.as.object->classObject != sequenceClass &&
+         sequence.as.object->classObject != mapClass))
+        abort("List expected in for loop.");
+
+    // Each loop over a lazy sequence pulls from a cursor of its own.
+    if (sequence.as.object->classObject == sequenceClass)
+        sequence.as.object = AS(sequence, Sequence)->cursor(this);
+
+    memory[slot + memoryOffset] = sequence;
+    memory[slot + 1 + memoryOffset] = newInt(0);
+}
+
+// Pushes the next element of the loop in slot, or returns false when done.
+bool VM::iterNext(int slot) {
+    Object *sequence = memory[slot + memoryOffset].as.object;
+
+    // Pulling may call script functions, which can move memory.
+    if (sequence->classObject == sequenceClass) {
+        Value item;
+        if (!static_cast<Sequence *>(sequence)->next(this, &item))
+            return false;
+
+        push(item);
+        return true;
+    }
+    Value &position = memory[slot + 1 + memoryOffset];
+    int index = position.as.integer;
+
+    if (sequence->classObject == listClass) {
+        List *list = static_cast<List *>(sequence);
+
+        if (index < list->size) {
+            push(list->items[index]);
+            position.as.integer = index + 1;
+            return true;
+        }
+    } else if (sequence->classObject == mapClass) {
+        // Maps loop over their keys.
+        Map *map = static_cast<Map *>(sequence);
+
+        if (index < map->entries.size()) {
+            Value key;
+            key.isObject = true;
+            key.isInt = false;
+            key.as.object = map->entries[index].key;
+
+            push(key);
+            position.as.integer = index + 1;
+            return true;
+        }
+    } else {
+        Float64Array *array = static_cast<Float64Array *>(sequence);
+
+        if (index < array->size) {
+            push(newNum(array->items[index]));
+            position.as.integer = index + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void VM::indexGet() {
+    Value index = pop();
+    Value &target = stack.back();
+
+    if (target.isObject && target.as.object->classObject == listClass) {
+        List *list = AS(target, List);
+        int i = toIndex(index, list->size);
+
+        target = list->items[i];
+    } else if (target.isObject && target.as.object->classObject == float64ArrayClass) {
+        Float64Array *array = AS(target, Float64Array);
+        int i = toIndex(index, array->size);
+
+        target = newNum(array->items[i]);
+    } else if (target.isObject && target.as.object->classObject == mapClass) {
+        Value *value = AS(target, Map)->get(this, index);
+        if (value == nullptr)
+            abort("Key not found.");
+
+        target = *value;
+    } else {
+        abort("Cannot index " + valueToStr(this, target) + ".");
+    }
+}
+
+void VM::indexSet() {
+    Value value = pop();
+    Value index = pop();
+    Value target = pop();
+
+    if (target.isObject && target.as.object->classObject == listClass) {
+        List *list = AS(target, List);
+        int i = toIndex(index, list->size);
+
+        list->items[i] = retain(this, value);
+    } else if (target.isObject && target.as.object->classObject == float64ArrayClass) {
+        Float64Array *array = AS(target, Float64Array);
+        int i = toIndex(index, array->size);
+
+        array->items[i] = asNum(value);
+    } else if (target.isObject && target.as.object->classObject == mapClass) {
+        AS(target, Map)->set(this, index, value);
+    } else {
+        abort("Cannot index " + valueToStr(this, target) + ".");
+    }
+}
+
+void VM::buildList(int count) {
+    Value list = newList(this);
+
+    for (int i = 1; i <= count; i++)
+        stack.end()[-i] = retain(this, stack.end()[-i]);
+
+    AS(list, List)->reserve(count);
+    AS(list, List)->addAll(&stack.end()[-count], count);
+    stack.resize(stack.size() - count);
+
+    push(list);
+}
+
+void VM::makeClosure(Function *fn) {
+    Closure *created = new Closure(this, fn);
+
+    for (auto &info : fn->upvalues) {
+        if (info.isLocal)
+            created->upvalues.push_back(captureUpvalue(memoryOffset + info.index));
+        else
+            created->upvalues.push_back(closure->upvalues[info.index]);
+    }
+
+    Value value;
+    value.isObject = true;
+    value.isInt = false;
+    value.as.object = created;
+    push(value);
+}
+
 void VM::callMethod(uint8_t code, uint8_t depth) {
     Value *args = &(stack.end()[- depth - 1]);
     for (int i = 0; i < depth + 1; i++)
         stack.pop_back();
 
-    std::map<int, std::function<void(VM *vm, Value *args)> > *symbols;
+    ObjectClass *classObject = args[0].isObject ? args[0].as.object->classObject : numClass;
+    Native method = classObject->methods[code];
 
-    if (!args[0].isObject)
-        symbols = &numClass->symbols;
-    else
-        symbols = &args[0].as.object->classObject->symbols;
+    if (method != nullptr) {
+        // Natives read their arguments without checking how many there are.
+        int fewest = coreSymbolArgs[code][0];
+        int most = coreSymbolArgs[code][1];
 
-    auto it = symbols->find(code);
-    if (it != symbols->end()) {
-        it->second(this, args);
+        if (depth < fewest || depth > most) {
+            abort("Expected " + std::to_string(fewest) +
+                  (fewest == most ? "" : " to " + std::to_string(most)) + " arguments.");
+        }
+
+        // Every call leaves exactly one value; natives without a result give 0.
+        int height = stack.size();
+        argCount = depth;
+        method(this, args);
+
+        if (stack.size() == height)
+            push(newInt(0));
     } else {
-        std::string symbol = "";
+        std::string symbol = code < CORE_SYMBOLS ? coreSymbolNames[code] : "";
         for (auto it : compiler->symbolsTable) {
             if (it.second == code) {
                 symbol = it.first;
@@ -962,67 +1971,446 @@ void VM::callMethod(uint8_t code, uint8_t depth) {
             } 
         }
 
-        printf("Missing method %s on %s\n", symbol.c_str(), valueToStr(this, args[0]).c_str());
-        exit(0);
+        abort("Missing method " + symbol + " on " + valueToStr(this, args[0]) + ".");
     }
 }
 
-void VM::callFunction(uint8_t depth) {
-    Value function = stack.end()[- depth - 1];
-
-    Function *fn = AS(function, Function);
+// What calling target with count arguments runs, and the closure it runs
+// in if any. Verified code assumes a function starts with exactly arity
+// values on its stack, so that is checked here, once per call.
+static Function *calleeFunction(VM *vm, Value target, int count, Closure **closure) {
+    if (!target.isObject ||
+        (target.as.object->classObject != vm->functionClass &&
+         target.as.object->classObject != vm->closureClass))
+        abort("Function expected.");
+
+    Function *fn;
+    *closure = nullptr;
+
+    if (target.as.object->classObject == vm->closureClass) {
+        *closure = AS(target, Closure);
+        fn = (*closure)->function;
+    } else {
+        fn = AS(target, Function);
+    }
 
-    if (!fn->foreign) {
-        pushFrame();
+    if (fn->arity != count)
+        abort("Expected " + std::to_string(fn->arity) + " arguments.");
 
-        stack.erase(stack.end() - depth - 1);
+    return fn;
+}
 
-        ip = &fn->code.front();
-        constants = fn->constants;
-        memoryOffset = memory.size();
+// Enters the function below the arguments. Returns it if it is a script
+// function whose frame is now running, or nullptr if it was a native.
+Function *VM::callFunction(uint8_t depth) {
+    Closure *callee;
+    Function *fn = calleeFunction(this, stack.end()[- depth - 1], depth, &callee);
 
-        for (int i=0; i<fn->localCount; i++) {
-            memory.push_back({});
-        }
-    } else {
+    if (fn->foreign) {
         Value *args = &(stack.end()[- depth - 1]);
         for (int i = 0; i < depth + 1; i++)
             stack.pop_back();
 
-        functions[fn](this, args);
+        int height = stack.size();
+        fn->body(this, args);
+
+        if (stack.size() == height)
+            push(newInt(0));
+        return nullptr;
+    }
+
+    if (!fn->verified)
+        verifyFunction(this, fn);
+
+    pushFrame();
+
+    stack.erase(stack.end() - depth - 1);
+
+    ip = &fn->code.front();
+    constants = fn->constants.data();
+    closure = callee;
+    function = fn;
+    memoryOffset = memory.size();
+
+    memory.resize(memoryOffset + fn->localCount);
+
+    if (jit && fn->native == nullptr && ++fn->calls == jitThreshold)
+        jitCompile(this, fn);
+
+    return fn;
+}
+
+Function *VM::tailCall(uint8_t depth) {
+    Closure *callee;
+    Function *fn = calleeFunction(this, stack.end()[- depth - 1], depth, &callee);
+
+    if (fn->foreign)
+        return callFunction(depth);
+
+    if (!fn->verified)
+        verifyFunction(this, fn);
+
+    // Same as callFunction, but the caller's frame is replaced rather than
+    // saved: its locals are dropped and the callee runs in the same window.
+    stack.erase(stack.end() - depth - 1);
+
+    if (!openUpvalues.empty())
+        closeUpvalues(memoryOffset);
+
+    ip = &fn->code.front();
+    constants = fn->constants.data();
+    closure = callee;
+    function = fn;
+
+    memory.resize(memoryOffset + fn->localCount);
+
+    if (jit && fn->native == nullptr && ++fn->calls == jitThreshold)
+        jitCompile(this, fn);
+
+    return fn;
+}
+
+Value VM::call(Value callee, const Value *args, int count) {
+    Closure *target;
+    calleeFunction(this, callee, count, &target);
+
+    push(callee);
+    for (int i = 0; i < count; i++)
+        push(args[i]);
+
+    callbacks++;
+    Function *fn = callFunction(count);
+
+    if (fn != nullptr) {
+        nativeDepth++;
+        if (fn->native != nullptr && nativeDepth < MAX_NATIVE_DEPTH)
+            fn->native(this);
+        else
+            execute(frames.size());
+        nativeDepth--;
+    }
+
+    callbacks--;
+    return pop();
+}
+
+// Runs the popped coroutine from where it last yielded, or from the start.
+// Its frames go on top of the current ones, with the bottom frame returning
+// here, so execute carries on into it without a nested call.
+void VM::resume() {
+    Value target = pop();
+
+    if (!target.isObject || target.as.object->classObject != coroutineClass)
+        abort("Coroutine expected.");
+
+    Coroutine *co = AS(target, Coroutine);
+
+    if (co->state == Coroutine::RUNNING)
+        abort("Coroutine is already running.");
+    if (co->state == Coroutine::DONE)
+        abort("Coroutine is finished.");
+
+    co->frameBase = frames.size();
+    co->stackBase = stack.size();
+    co->memoryBase = memory.size();
+    co->resumer = coroutine;
+    co->state = Coroutine::RUNNING;
+    coroutine = co;
+
+    if (co->suspended.ip == nullptr) {
+        // Its frames are interpreted even if compiled, so it can yield.
+        push(co->callee);
+        callFunction(0);
+        return;
+    }
+
+    int base = co->memoryBase;
+
+    co->frames[0] = CallFrame(ip, constants, closure, function, memoryOffset);
+    for (int i = 1; i < co->frames.size(); i++)
+        co->frames[i].memorySize += base;
+
+    frames.insert(frames.end(), co->frames.begin(), co->frames.end());
+    if (!co->stack.empty())
+        stack.insert(stack.end(), co->stack.begin(), co->stack.end());
+    if (!co->memory.empty())
+        memory.insert(memory.end(), co->memory.begin(), co->memory.end());
+
+    // Closures may have changed captured locals while it was suspended.
+    for (auto &captured : co->upvalues) {
+        Upvalue *upvalue = captured.first;
+        upvalue->slot = base + captured.second;
+        upvalue->open = true;
+        memory[upvalue->slot] = upvalue->closed;
+        openUpvalues.push_back(upvalue);
+    }
+
+    ip = co->suspended.ip;
+    constants = co->suspended.constants;
+    closure = co->suspended.closure;
+    function = co->suspended.function;
+    memoryOffset = base + co->suspended.memorySize;
+
+    co->frames.clear();
+    co->stack.clear();
+    co->memory.clear();
+    co->upvalues.clear();
+}
+
+// Moves the running coroutine's frames, temporaries and locals off the VM
+// and returns the popped value to where it was resumed.
+void VM::yield(int exitDepth) {
+    Value value = retain(this, pop());
+    Coroutine *co = coroutine;
+
+    if (co == nullptr)
+        abort("Yield outside of a coroutine.");
+
+    // A frame below this execute belongs to native code still on the C++
+    // stack, which can't be set aside.
+    if (exitDepth > co->frameBase)
+        abort("Cannot yield across a native call.");
+
+    int base = co->memoryBase;
+
+    for (int i = 0; i < openUpvalues.size();) {
+        Upvalue *upvalue = openUpvalues[i];
+
+        if (upvalue->slot >= base) {
+            co->upvalues.push_back({upvalue, upvalue->slot - base});
+            upvalue->closed = memory[upvalue->slot];
+            upvalue->open = false;
+
+            openUpvalues[i] = openUpvalues.back();
+            openUpvalues.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    co->suspended = CallFrame(ip, constants, closure, function, memoryOffset - base);
+
+    co->frames.assign(frames.begin() + co->frameBase, frames.end());
+    for (int i = 1; i < co->frames.size(); i++)
+        co->frames[i].memorySize -= base;
+
+    co->stack.assign(stack.begin() + co->stackBase, stack.end());
+    co->memory.assign(memory.begin() + base, memory.end());
+
+    CallFrame &resumer = frames[co->frameBase];
+    ip = resumer.ip;
+    constants = resumer.constants;
+    closure = resumer.closure;
+    function = resumer.function;
+    memoryOffset = resumer.memorySize;
+
+    frames.erase(frames.begin() + co->frameBase, frames.end());
+    stack.resize(co->stackBase);
+    memory.resize(base);
+
+    co->state = Coroutine::SUSPENDED;
+    coroutine = co->resumer;
+
+    push(value);
+}
+
+Upvalue *VM::captureUpvalue(int slot) {
+    for (auto upvalue : openUpvalues) {
+        if (upvalue->slot == slot)
+            return upvalue;
+    }
+
+    Upvalue *upvalue = new Upvalue();
+    upvalue->slot = slot;
+    upvalue->open = true;
+
+    openUpvalues.push_back(upvalue);
+    return upvalue;
+}
+
+void VM::closeUpvalues(int from) {
+    for (int i = 0; i < openUpvalues.size();) {
+        Upvalue *upvalue = openUpvalues[i];
+
+        if (upvalue->slot >= from) {
+            upvalue->closed = retain(this, memory[upvalue->slot]);
+            upvalue->open = false;
+
+            openUpvalues[i] = openUpvalues.back();
+            openUpvalues.pop_back();
+        } else {
+            i++;
+        }
     }
 }
 
 void VM::pushFrame() {
-    frames.push_back({ip, constants, memoryOffset});
+    frames.push_back({ip, constants, closure, function, memoryOffset});
 }
 
 void VM::popFrame() {
-    int remove = memory.size() - memoryOffset;
-    for (int i=0; i<remove; i++) {
-        memory.pop_back();
-    }
+    if (!openUpvalues.empty())
+        closeUpvalues(memoryOffset);
+
+    memory.resize(memoryOffset);
 
     auto &frame = frames.back();
     ip = frame.ip;
     constants = frame.constants;
+    closure = frame.closure;
+    function = frame.function;
     memoryOffset = frame.memorySize;
 
     frames.pop_back();
+
+    // Returning from its bottom frame finishes a coroutine; its result is
+    // what resume gives back.
+    if (coroutine != nullptr && frames.size() == coroutine->frameBase) {
+        coroutine->state = Coroutine::DONE;
+        coroutine = coroutine->resumer;
+    }
 }
 
+#ifndef NO_MAIN
+
 int main(int argc, char** argv) {
-    if (argc < 2) {
+    bool inlining = true;
+    bool jit = false;
+    int jitThreshold = 1000;
+    bool report = false;
+    bool reportStartup = false;
+    int workers = 0;
+    int64_t slice = 0;
+    std::string emitPath;
+    std::string resumePath;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--no-inline") {
+            inlining = false;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if (arg == "--jit-threshold" && i + 1 < argc) {
+            jit = true;
+            jitThreshold = atoi(argv[++i]);
+        } else if (arg == "--report-specialized") {
+            report = true;
+        } else if (arg == "--report-startup") {
+            reportStartup = true;
+        } else if (arg == "--emit-cpp" && i + 1 < argc) {
+            emitPath = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--slice" && i + 1 < argc) {
+            slice = atoll(argv[++i]);
+        } else if (arg == "--resume" && i + 1 < argc) {
+            resumePath = argv[++i];
+        } else {
+            filenames.push_back(arg);
+        }
+    }
+
+    if (filenames.empty() && resumePath == "") {
         printf("Pass filename as argument.\n");
         return 0;
     }
 
-    std::ifstream t(argv[1]);
-    std::string code((std::istreambuf_iterator<char>(t)),
-                     std::istreambuf_iterator<char>());
+    // Several files run as one batch, each script in its own VM.
+    if (filenames.size() > 1 && emitPath == "") {
+        std::vector<std::string> sources;
+        for (auto &filename : filenames) {
+            std::ifstream t(filename);
+            sources.push_back(std::string((std::istreambuf_iterator<char>(t)),
+                                          std::istreambuf_iterator<char>()));
+        }
+
+        std::vector<ScriptResult> results;
 
+        // With a slice, scripts take turns as green threads instead of
+        // each holding a thread until it finishes.
+        if (slice > 0) {
+            Scheduler scheduler(workers, slice);
+            scheduler.inlining = inlining;
+            scheduler.jit = jit;
+            scheduler.jitThreshold = jitThreshold > 0 ? jitThreshold : 1;
+
+            for (auto &source : sources)
+                scheduler.spawn(source);
+            results = scheduler.wait();
+        } else {
+            ScriptPool pool(workers);
+            pool.inlining = inlining;
+            pool.jit = jit;
+            pool.jitThreshold = jitThreshold > 0 ? jitThreshold : 1;
+
+            results = pool.run(sources);
+        }
+
+        for (int i = 0; i < results.size(); i++) {
+            if (!results[i].ok)
+                error(filenames[i] + ": " + results[i].error);
+        }
+
+        return 0;
+    }
+
+    std::string code;
+    if (resumePath == "") {
+        std::ifstream t(filenames.back());
+        code.assign(std::istreambuf_iterator<char>(t), std::istreambuf_iterator<char>());
+    }
+
+    auto constructing = std::chrono::steady_clock::now();
     VM vm;
-    vm.run(code);
+    auto constructed = std::chrono::steady_clock::now();
+
+    if (reportStartup) {
+        std::cerr << "VM construction took "
+                  << std::chrono::duration<double, std::micro>(constructed - constructing).count()
+                  << " us." << std::endl;
+    }
+
+    vm.inlining = inlining;
+    vm.jit = jit;
+    vm.jitThreshold = jitThreshold > 0 ? jitThreshold : 1;
+    vm.workers = workers;
+
+    if (emitPath != "") {
+        try {
+            std::ofstream out(emitPath);
+            emitCpp(&vm, vm.compile(code), code, out);
+        } catch (ScriptError &e) {
+            error(e.message);
+        }
+        return 0;
+    }
+
+    std::string message;
+
+    // A snapshot stands in for the script: the heap is loaded as it was and
+    // top-level code carries on from the snapshot() call.
+    bool loaded = resumePath != "" ? vm.restore(resumePath, &message) : vm.load(code, &message);
+
+    // With --slice a lone script runs in slices too, so a top-level yield
+    // means the same as it does in a batch.
+    VM::Status status = VM::FAILED;
+    if (loaded) {
+        do {
+            status = vm.runFor(slice, &message);
+        } while (status == VM::PREEMPTED);
+    }
+
+    if (status != VM::FINISHED)
+        error(message);
+
+    if (report) {
+        std::cerr << "Specialized " << vm.specialized << " of " << vm.specializable
+                  << " numeric operations." << std::endl;
+    }
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,334 @@
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "value.hpp"
+
+// A range of list indices run as one task.
+struct Chunk {
+    int index;
+    int begin;
+    int end;
+};
+
+// Chunks waiting to run on one worker. The owner takes from the back and
+// idle workers steal from the front, so each keeps to neighbouring items.
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<Chunk> chunks;
+
+    bool pop(Chunk *chunk) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (chunks.empty())
+            return false;
+
+        *chunk = chunks.back();
+        chunks.pop_back();
+        return true;
+    }
+
+    bool steal(Chunk *chunk) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (chunks.empty())
+            return false;
+
+        *chunk = chunks.front();
+        chunks.pop_front();
+        return true;
+    }
+};
+
+static int workerCount(VM *vm) {
+    if (vm->workers > 0)
+        return vm->workers;
+
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// A VM for one worker thread. It shares the caller's compiled code but has
+// its own copy of memory, so globals and captured locals read as they were
+// at the call. Nested parallel calls in it run inline.
+static std::unique_ptr<VM> workerVM(VM *vm) {
+    std::unique_ptr<VM> worker(new VM());
+
+    worker->memory = vm->memory;
+    worker->compiler->varOffset = vm->compiler->varOffset;
+    worker->compiler->symbolsTable = vm->compiler->symbolsTable;
+    worker->inlining = vm->inlining;
+    worker->workers = 1;
+
+    return worker;
+}
+
+// Calls work(self, failed) on each of workers threads, the calling thread
+// being worker 0. work should stop taking tasks once failed is set. The
+// first error raised sets it and is raised again in the caller.
+template <typename Work>
+static void runWorkers(int workers, Work work) {
+    std::atomic<bool> failed(false);
+    std::mutex errorLock;
+    std::string error;
+
+    auto guarded = [&](int self) {
+        try {
+            work(self, failed);
+        } catch (ScriptError &e) {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if (!failed)
+                error = e.message;
+            failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+        threads.emplace_back(guarded, i);
+
+    guarded(0);
+
+    for (auto &thread : threads)
+        thread.join();
+
+    if (failed)
+        abort(error);
+}
+
+// Splits [0, size) into chunks, deals them out in contiguous runs and calls
+// run(worker, chunk) for each on some thread.
+template <typename Run>
+static void runChunks(VM *vm, int size, int count, int workers, Run run) {
+    // Workers print into buffers of their own, written out as their VMs
+    // go; what the caller printed before the call comes first.
+    vm->output.flush();
+
+    std::vector<std::unique_ptr<VM> > vms;
+    for (int i = 0; i < workers; i++)
+        vms.push_back(workerVM(vm));
+
+    // count <= size, so no chunk is empty.
+    std::vector<WorkQueue> queues(workers);
+
+    for (int i = 0; i < count; i++) {
+        int begin = (int64_t) size * i / count;
+        int end = (int64_t) size * (i + 1) / count;
+        queues[i * workers / count].chunks.push_back({i, begin, end});
+    }
+
+    runWorkers(workers, [&](int self, std::atomic<bool> &failed) {
+        Chunk chunk;
+
+        while (!failed) {
+            bool found = queues[self].pop(&chunk);
+
+            for (int i = 1; i < workers && !found; i++)
+                found = queues[(self + i) % workers].steal(&chunk);
+
+            if (!found)
+                return;
+
+            run(vms[self].get(), chunk);
+        }
+    });
+}
+
+// About four chunks per worker leaves room for stealing without making
+// chunks so small that taking them costs more than running them.
+static int chunkCount(int size, int workers) {
+    return std::min(size, workers * 4);
+}
+
+Value parallelMap(VM *vm, List *list, Value fn) {
+    int size = list->size;
+    int workers = std::min(workerCount(vm), size);
+
+    std::vector<Value> results(size);
+
+    if (workers <= 1) {
+        for (int i = 0; i < size; i++)
+            results[i] = retain(vm, vm->call(fn, &list->items[i], 1));
+    } else {
+        runChunks(vm, size, chunkCount(size, workers), workers, [&](VM *worker, Chunk chunk) {
+            for (int i = chunk.begin; i < chunk.end; i++)
+                results[i] = retain(worker, worker->call(fn, &list->items[i], 1));
+        });
+    }
+
+    Value out = newList(vm);
+    AS(out, List)->addAll(results.data(), size);
+    return out;
+}
+
+Value parallelReduce(VM *vm, List *list, Value fn, Value init) {
+    int size = list->size;
+    int workers = std::min(workerCount(vm), size);
+
+    Value args[2] = {init};
+
+    if (workers <= 1) {
+        for (int i = 0; i < size; i++) {
+            args[1] = list->items[i];
+            args[0] = vm->call(fn, args, 2);
+        }
+
+        return args[0];
+    }
+
+    // Each chunk folds its own items; the partial results are then folded
+    // into init in list order.
+    int count = chunkCount(size, workers);
+    std::vector<Value> partials(count);
+
+    runChunks(vm, size, count, workers, [&](VM *worker, Chunk chunk) {
+        Value acc[2] = {list->items[chunk.begin]};
+
+        for (int i = chunk.begin + 1; i < chunk.end; i++) {
+            acc[1] = list->items[i];
+            acc[0] = worker->call(fn, acc, 2);
+        }
+
+        partials[chunk.index] = acc[0];
+    });
+
+    for (int i = 0; i < count; i++) {
+        args[1] = partials[i];
+        args[0] = vm->call(fn, args, 2);
+    }
+
+    return args[0];
+}
+
+// Runs task(self, i) for i in [0, count), spread over up to workers threads.
+template <typename Task>
+static void parallelFor(int workers, int count, Task task) {
+    std::atomic<int> next(0);
+
+    runWorkers(std::min(workers, count), [&](int self, std::atomic<bool> &failed) {
+        int i;
+        while (!failed && (i = next++) < count)
+            task(self, i);
+    });
+}
+
+// Below this many items, sorting on one thread beats starting workers.
+static const int PARALLEL_SORT_MIN = 1 << 14;
+
+// Sorts items stably, less(self, a, b) comparing on worker self. On more
+// than one worker, runs of the items are sorted at the same time and then
+// merged pairwise a level at a time, each level's merges in parallel too.
+template <typename Less>
+static void mergeSort(Value *items, int size, int workers, Less less) {
+    if (workers <= 1) {
+        std::stable_sort(items, items + size, [&](Value a, Value b) { return less(0, a, b); });
+        return;
+    }
+
+    // A power of two of runs, so that they pair off at every level.
+    int runs = 1;
+    while (runs < workers)
+        runs *= 2;
+
+    std::vector<int> bounds(runs + 1);
+    for (int i = 0; i <= runs; i++)
+        bounds[i] = (int64_t) size * i / runs;
+
+    std::vector<Value> buffer(size);
+    Value *from = items;
+    Value *to = buffer.data();
+
+    parallelFor(workers, runs, [&](int self, int i) {
+        std::stable_sort(from + bounds[i], from + bounds[i + 1],
+                         [&](Value a, Value b) { return less(self, a, b); });
+    });
+
+    for (int width = 1; width < runs; width *= 2) {
+        parallelFor(workers, runs / (2 * width), [&](int self, int pair) {
+            int begin = bounds[pair * 2 * width];
+            int middle = bounds[pair * 2 * width + width];
+            int end = bounds[(pair + 1) * 2 * width];
+
+            // merge takes from the left run on ties, which keeps it stable.
+            std::merge(from + begin, from + middle, from + middle, from + end, to + begin,
+                       [&](Value a, Value b) { return less(self, a, b); });
+        });
+
+        std::swap(from, to);
+    }
+
+    if (from != items)
+        std::copy(from, from + size, items);
+}
+
+void parallelSort(VM *vm, List *list, const Value *compare) {
+    int size = list->size;
+    int workers = size < PARALLEL_SORT_MIN ? 1 : workerCount(vm);
+
+    // Sorting a copy leaves the list as it was if compare fails.
+    std::vector<Value> items(list->items, list->items + size);
+
+    if (compare != nullptr) {
+        Value fn = *compare;
+        std::vector<std::unique_ptr<VM> > vms;
+
+        if (workers > 1) {
+            vm->output.flush();
+
+            for (int i = 0; i < workers; i++)
+                vms.push_back(workerVM(vm));
+        }
+
+        mergeSort(items.data(), size, workers, [&](int self, Value a, Value b) {
+            VM *worker = vms.empty() ? vm : vms[self].get();
+            Value args[2] = {a, b};
+            Value order = worker->call(fn, args, 2);
+
+            if (order.isObject)
+                abort("Comparator must return a number.");
+
+            return order.isInt ? order.as.integer < 0 : order.as.num < 0;
+        });
+
+        if (list->size != size)
+            abort("List changed while sorting.");
+    } else {
+        bool ints = true;
+        bool nums = true;
+        bool strings = true;
+
+        for (Value &item : items) {
+            if (item.isObject) {
+                ints = nums = false;
+                strings = strings && item.as.object->classObject == vm->strClass;
+            } else {
+                ints = ints && item.isInt;
+                strings = false;
+            }
+        }
+
+        if (size == 0) {
+            return;
+        } else if (ints) {
+            mergeSort(items.data(), size, workers, [](int, Value a, Value b) {
+                return a.as.integer < b.as.integer;
+            });
+        } else if (nums) {
+            // NaN goes last, so that the order stays strict.
+            mergeSort(items.data(), size, workers, [](int, Value a, Value b) {
+                double x = asNum(a);
+                double y = asNum(b);
+                return x < y || (isnan(y) && !isnan(x));
+            });
+        } else if (strings) {
+            mergeSort(items.data(), size, workers, [](int, Value a, Value b) {
+                return AS(a, String)->value < AS(b, String)->value;
+            });
+        } else {
+            abort("Only lists of numbers or of strings sort without a comparator.");
+        }
+    }
+
+    std::copy(items.begin(), items.end(), list->items);
+}
@@ -0,0 +1,174 @@
+#include <algorithm>
+
+#include "pool.hpp"
+
+ScriptPool::ScriptPool(int count) :
+    sources(nullptr),
+    next(0),
+    remaining(0),
+    stopping(false),
+    inlining(true),
+    jit(false),
+    jitThreshold(1000)
+{
+    if (count <= 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < count; i++)
+        workers.emplace_back(&ScriptPool::work, this);
+}
+
+ScriptPool::~ScriptPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ScriptPool::work() {
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true) {
+        wake.wait(guard, [this] {
+            return stopping || (sources != nullptr && next < sources->size());
+        });
+
+        if (stopping)
+            return;
+
+        int i = next++;
+        const std::string &source = (*sources)[i];
+        guard.unlock();
+
+        VM vm;
+        vm.inlining = inlining;
+        vm.jit = jit;
+        vm.jitThreshold = jitThreshold;
+
+        ScriptResult result;
+        result.ok = vm.run(source, &result.error);
+
+        guard.lock();
+        results[i] = result;
+
+        if (--remaining == 0)
+            finished.notify_all();
+    }
+}
+
+std::vector<ScriptResult> ScriptPool::run(const std::vector<std::string> &batchSources) {
+    std::lock_guard<std::mutex> running(batch);
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (batchSources.empty())
+        return {};
+
+    sources = &batchSources;
+    results.assign(batchSources.size(), ScriptResult());
+    next = 0;
+    remaining = batchSources.size();
+
+    wake.notify_all();
+    finished.wait(guard, [this] { return remaining == 0; });
+
+    sources = nullptr;
+    return std::move(results);
+}
+
+Scheduler::Scheduler(int count, int64_t slice) :
+    unfinished(0),
+    stopping(false),
+    slice(slice),
+    inlining(true),
+    jit(false),
+    jitThreshold(1000)
+{
+    if (count <= 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < count; i++)
+        workers.emplace_back(&Scheduler::work, this);
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void Scheduler::work() {
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true) {
+        wake.wait(guard, [this] { return stopping || !ready.empty(); });
+
+        if (stopping)
+            return;
+
+        Task *task = ready.front();
+        ready.pop_front();
+        guard.unlock();
+
+        VM &vm = task->vm;
+        VM::Status status = VM::FAILED;
+
+        if (!task->loaded) {
+            vm.inlining = inlining;
+            vm.jit = jit;
+            vm.jitThreshold = jitThreshold;
+            task->loaded = vm.load(task->source, &task->result.error);
+            task->source.clear();
+        }
+
+        if (task->loaded)
+            status = vm.runFor(slice, &task->result.error);
+
+        guard.lock();
+
+        if (status == VM::PREEMPTED) {
+            ready.push_back(task);
+            wake.notify_one();
+            continue;
+        }
+
+        task->result.ok = status == VM::FINISHED;
+
+        if (--unfinished == 0)
+            idle.notify_all();
+    }
+}
+
+int Scheduler::spawn(std::string source) {
+    std::unique_ptr<Task> task(new Task());
+    task->source = source;
+    task->loaded = false;
+    task->result.ok = false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    tasks.push_back(std::move(task));
+    ready.push_back(tasks.back().get());
+    unfinished++;
+
+    wake.notify_one();
+    return tasks.size() - 1;
+}
+
+std::vector<ScriptResult> Scheduler::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return unfinished == 0; });
+
+    std::vector<ScriptResult> results;
+    for (auto &task : tasks)
+        results.push_back(task->result);
+
+    return results;
+}
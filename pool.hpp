@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "value.hpp"
+
+// Outcome of one script in a batch.
+struct ScriptResult {
+    bool ok;
+    std::string error;
+};
+
+// A fixed set of worker threads running independent scripts. Each script
+// gets a VM of its own, so nothing but the read-only core is shared.
+class ScriptPool {
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    // The batch being run, and how far the workers have got through it.
+    const std::vector<std::string> *sources;
+    std::vector<ScriptResult> results;
+    int next;
+    int remaining;
+    bool stopping;
+
+    // One batch at a time.
+    std::mutex batch;
+
+    void work();
+
+public:
+    // Settings for every VM the pool creates.
+    bool inlining;
+    bool jit;
+    int jitThreshold;
+
+    // count <= 0 uses one worker per hardware thread.
+    explicit ScriptPool(int count = 0);
+    ~ScriptPool();
+
+    // Runs every source and waits for all of them; results are in order.
+    std::vector<ScriptResult> run(const std::vector<std::string> &sources);
+};
+
+// Runs many scripts as green threads over a few OS threads. A task runs for
+// a slice of back-edges and calls, or until it yields outside a coroutine,
+// then goes to the back of the queue and later resumes where it stopped, on
+// whichever thread picks it up.
+class Scheduler {
+    struct Task {
+        VM vm;
+        std::string source;
+        bool loaded;
+        ScriptResult result;
+    };
+
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+
+    std::vector<std::unique_ptr<Task> > tasks;
+    std::deque<Task *> ready;
+    int unfinished;
+    bool stopping;
+
+    void work();
+
+public:
+    // Back-edges and calls per slice.
+    int64_t slice;
+
+    // Settings for every task's VM.
+    bool inlining;
+    bool jit;
+    int jitThreshold;
+
+    // count <= 0 uses one thread per hardware thread.
+    explicit Scheduler(int count = 0, int64_t slice = 10000);
+    ~Scheduler();
+
+    // Queues source as a new task and returns its id.
+    int spawn(std::string source);
+
+    // Waits until every task spawned so far has finished; results are by id.
+    std::vector<ScriptResult> wait();
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "value.hpp"
+
+// Entry points for compiled code, shared by the JIT and by C++ emitted with
+// --emit-cpp. Each one does the work of a single opcode on the VM's stack
+// and memory, exactly like execute does.
+struct Runtime {
+    static void push(VM *vm, Value *constant) {
+        vm->push(*constant);
+    }
+
+    static void pop(VM *vm) {
+        vm->pop();
+    }
+
+    // Pops the condition and returns true if JEQ takes its jump.
+    static bool isFalse(VM *vm) {
+        Value condition = vm->pop();
+        return condition.isInt ? condition.as.integer == 0 : condition.as.num == 0;
+    }
+
+    static void mem(VM *vm, int slot) {
+        vm->push(vm->memory[slot + vm->memoryOffset]);
+    }
+
+    static void memSet(VM *vm, int slot) {
+        vm->memory[slot + vm->memoryOffset] = retain(vm, vm->pop());
+    }
+
+    // The store of a loop variable straight after ITER_NEXT, which keeps
+    // a view as it is.
+    static void loopSet(VM *vm, int slot) {
+        vm->memory[slot + vm->memoryOffset] = vm->pop();
+    }
+
+    static void global(VM *vm, int slot) {
+        vm->push(vm->memory[slot]);
+    }
+
+    static void getUpvalue(VM *vm, int index) {
+        Upvalue *upvalue = vm->closure->upvalues[index];
+        vm->push(upvalue->open ? vm->memory[upvalue->slot] : upvalue->closed);
+    }
+
+    static void setUpvalue(VM *vm, int index) {
+        Upvalue *upvalue = vm->closure->upvalues[index];
+
+        if (upvalue->open)
+            vm->memory[upvalue->slot] = retain(vm, vm->pop());
+        else
+            upvalue->closed = retain(vm, vm->pop());
+    }
+
+    static void closure(VM *vm, Function *fn) {
+        vm->makeClosure(fn);
+    }
+
+    static void iterInit(VM *vm, int slot) {
+        vm->iterInit(slot);
+    }
+
+    static bool iterNext(VM *vm, int slot) {
+        return vm->iterNext(slot);
+    }
+
+    static void indexGet(VM *vm) {
+        vm->indexGet();
+    }
+
+    static void indexSet(VM *vm) {
+        vm->indexSet();
+    }
+
+    static void buildList(VM *vm, int count) {
+        vm->buildList(count);
+    }
+
+    static void add(VM *vm) {
+        Value b = vm->pop();
+        vm->stack.back() = numAdd(vm->stack.back(), b);
+    }
+
+    static void sub(VM *vm) {
+        Value b = vm->pop();
+        vm->stack.back() = numSub(vm->stack.back(), b);
+    }
+
+    static void mul(VM *vm) {
+        Value b = vm->pop();
+        vm->stack.back() = numMul(vm->stack.back(), b);
+    }
+
+    static void div(VM *vm) {
+        Value b = vm->pop();
+        vm->stack.back() = numDiv(vm->stack.back(), b);
+    }
+
+    static void lt(VM *vm) {
+        Value b = vm->pop();
+        Value &a = vm->stack.back();
+        a = newInt(a.isInt && b.isInt ? a.as.integer < b.as.integer : asNum(a) < asNum(b));
+    }
+
+    static void gt(VM *vm) {
+        Value b = vm->pop();
+        Value &a = vm->stack.back();
+        a = newInt(a.isInt && b.isInt ? a.as.integer > b.as.integer : asNum(a) > asNum(b));
+    }
+
+    static void lteq(VM *vm) {
+        Value b = vm->pop();
+        Value &a = vm->stack.back();
+        a = newInt(a.isInt && b.isInt ? a.as.integer <= b.as.integer : asNum(a) <= asNum(b));
+    }
+
+    static void gteq(VM *vm) {
+        Value b = vm->pop();
+        Value &a = vm->stack.back();
+        a = newInt(a.isInt && b.isInt ? a.as.integer >= b.as.integer : asNum(a) >= asNum(b));
+    }
+
+    static void callMethod(VM *vm, int symbol, int depth) {
+        vm->callMethod(symbol, depth);
+    }
+
+    // Runs a script callee to completion, natively if it has been compiled
+    // and there is room for it on the C++ stack.
+    static void callFunction(VM *vm, int depth) {
+        Function *fn = vm->callFunction(depth);
+
+        if (fn == nullptr)
+            return;
+
+        vm->nativeDepth++;
+        if (fn->native != nullptr && vm->nativeDepth < MAX_NATIVE_DEPTH)
+            fn->native(vm);
+        else
+            vm->execute(vm->frames.size());
+        vm->nativeDepth--;
+    }
+
+    // Returns the native code to jump to for the callee, finished() if the
+    // callee already ran and returned, or nullptr if it was a native and
+    // the RETURN after the TAIL_CALL still has to run.
+    static void *tailCall(VM *vm, int depth) {
+        Function *fn = vm->tailCall(depth);
+
+        if (fn == nullptr)
+            return nullptr;
+
+        if (fn->native != nullptr)
+            return (void *) fn->native;
+
+        vm->execute(vm->frames.size());
+        return finished();
+    }
+
+    static void *finished() {
+        return (void *) 1;
+    }
+
+    static void ret(VM *vm) {
+        vm->popFrame();
+    }
+
+    static void del(VM *vm) {
+        Value target = vm->pop();
+        if (target.as.object->classObject != vm->stringViewClass)
+            delete target.as.object;
+    }
+};
@@ -0,0 +1,347 @@
+#include "simd.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef SIMD_X86
+
+static bool hasAvx() {
+    static bool avx = __builtin_cpu_supports("avx");
+    return avx;
+}
+
+__attribute__((target("avx")))
+static double avxSum(const double *a, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    for (; i < n; i++)
+        sum += a[i];
+
+    return sum;
+}
+
+__attribute__((target("avx")))
+static double avxDot(const double *a, const double *b, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+__attribute__((target("avx")))
+static double avxMin(const double *a, int n) {
+    __m256d acc = _mm256_set1_pd(a[0]);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double min = lanes[0];
+    for (int l = 1; l < 4; l++)
+        if (lanes[l] < min) min = lanes[l];
+
+    for (; i < n; i++)
+        if (a[i] < min) min = a[i];
+
+    return min;
+}
+
+__attribute__((target("avx")))
+static double avxMax(const double *a, int n) {
+    __m256d acc = _mm256_set1_pd(a[0]);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double max = lanes[0];
+    for (int l = 1; l < 4; l++)
+        if (lanes[l] > max) max = lanes[l];
+
+    for (; i < n; i++)
+        if (a[i] > max) max = a[i];
+
+    return max;
+}
+
+__attribute__((target("avx")))
+static void avxScale(double *a, int n, double s) {
+    __m256d factor = _mm256_set1_pd(s);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+
+    for (; i < n; i++)
+        a[i] *= s;
+}
+
+__attribute__((target("avx")))
+static void avxAdd(double *a, const double *b, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+
+    for (; i < n; i++)
+        a[i] += b[i];
+}
+
+__attribute__((target("avx")))
+static void avxFill(double *a, int n, double v) {
+    __m256d value = _mm256_set1_pd(v);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, value);
+
+    for (; i < n; i++)
+        a[i] = v;
+}
+
+static double sseSum(const double *a, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+
+    for (; i < n; i++)
+        sum += a[i];
+
+    return sum;
+}
+
+static double sseDot(const double *a, const double *b, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double sum = lanes[0] + lanes[1];
+
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+static double sseMin(const double *a, int n) {
+    __m128d acc = _mm_set1_pd(a[0]);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+
+    for (; i < n; i++)
+        if (a[i] < min) min = a[i];
+
+    return min;
+}
+
+static double sseMax(const double *a, int n) {
+    __m128d acc = _mm_set1_pd(a[0]);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+
+    for (; i < n; i++)
+        if (a[i] > max) max = a[i];
+
+    return max;
+}
+
+static void sseScale(double *a, int n, double s) {
+    __m128d factor = _mm_set1_pd(s);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+
+    for (; i < n; i++)
+        a[i] *= s;
+}
+
+static void sseAdd(double *a, const double *b, int n) {
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+
+    for (; i < n; i++)
+        a[i] += b[i];
+}
+
+static void sseFill(double *a, int n, double v) {
+    __m128d value = _mm_set1_pd(v);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(a + i, value);
+
+    for (; i < n; i++)
+        a[i] = v;
+}
+
+double simdSum(const double *a, int n) {
+    return hasAvx() ? avxSum(a, n) : sseSum(a, n);
+}
+
+double simdMin(const double *a, int n) {
+    if (n == 0) return 0;
+    return hasAvx() ? avxMin(a, n) : sseMin(a, n);
+}
+
+double simdMax(const double *a, int n) {
+    if (n == 0) return 0;
+    return hasAvx() ? avxMax(a, n) : sseMax(a, n);
+}
+
+double simdDot(const double *a, const double *b, int n) {
+    return hasAvx() ? avxDot(a, b, n) : sseDot(a, b, n);
+}
+
+void simdScale(double *a, int n, double s) {
+    if (hasAvx()) avxScale(a, n, s);
+    else sseScale(a, n, s);
+}
+
+void simdAdd(double *a, const double *b, int n) {
+    if (hasAvx()) avxAdd(a, b, n);
+    else sseAdd(a, b, n);
+}
+
+void simdFill(double *a, int n, double v) {
+    if (hasAvx()) avxFill(a, n, v);
+    else sseFill(a, n, v);
+}
+
+#else
+
+double simdSum(const double *a, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i];
+    return sum;
+}
+
+double simdMin(const double *a, int n) {
+    if (n == 0) return 0;
+
+    double min = a[0];
+    for (int i = 1; i < n; i++)
+        if (a[i] < min) min = a[i];
+    return min;
+}
+
+double simdMax(const double *a, int n) {
+    if (n == 0) return 0;
+
+    double max = a[0];
+    for (int i = 1; i < n; i++)
+        if (a[i] > max) max = a[i];
+    return max;
+}
+
+double simdDot(const double *a, const double *b, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+void simdScale(double *a, int n, double s) {
+    for (int i = 0; i < n; i++)
+        a[i] *= s;
+}
+
+void simdAdd(double *a, const double *b, int n) {
+    for (int i = 0; i < n; i++)
+        a[i] += b[i];
+}
+
+void simdFill(double *a, int n, double v) {
+    for (int i = 0; i < n; i++)
+        a[i] = v;
+}
+
+#endif
+
+// Sixteen bytes at a time with SSE2, which every x86-64 CPU has.
+const char *simdScanString(const char *p, const char *end) {
+#ifdef SIMD_X86
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lastControl = _mm_set1_epi8(0x1f);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+
+        // Unsigned bytes at most 0x1f are their own minimum with it.
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, lastControl), chunk);
+        __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                  _mm_cmpeq_epi8(chunk, backslash)), control);
+
+        int mask = _mm_movemask_epi8(found);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20)
+        p++;
+
+    return p;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Vectorized kernels over contiguous double storage. Each kernel picks
+// AVX or SSE2 at runtime where available and falls back to scalar code.
+
+double simdSum(const double *a, int n);
+double simdMin(const double *a, int n);
+double simdMax(const double *a, int n);
+double simdDot(const double *a, const double *b, int n);
+
+void simdScale(double *a, int n, double s);
+void simdAdd(double *a, const double *b, int n);
+void simdFill(double *a, int n, double v);
+
+// The first byte in [p, end) that ends or escapes a JSON string: a quote,
+// a backslash or a control character; end if there is none.
+const char *simdScanString(const char *p, const char *end);
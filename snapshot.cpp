@@ -0,0 +1,750 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <unordered_map>
+
+#include "value.hpp"
+
+// A snapshot is a header followed by a body. The body lists every object
+// reachable from memory, the stack and the top-level constants, first as
+// a table of kinds and lengths and then object by object, with references
+// between objects written as indices into that table. Loading allocates
+// every object from the table, then fills them in, turning indices back
+// into pointers.
+static const char MAGIC[8] = {'V', 'M', 'S', 'N', 'A', 'P', '\0', '\0'};
+static const uint32_t VERSION = 1;
+
+enum SnapshotKind {
+    KIND_STRING,
+    KIND_LIST,
+    KIND_FLOAT64_ARRAY,
+    KIND_MAP,
+    KIND_FUNCTION,
+    KIND_CLOSURE,
+    KIND_SEQUENCE,
+    KIND_FILE,
+    // One of the core globals, stored as its slot.
+    KIND_CORE,
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t checksum;
+    uint64_t size;
+};
+
+// FNV-1a, to catch a truncated or damaged file before trusting it.
+static uint64_t checksum(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint8_t) data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static Value objectValue(Object *object) {
+    Value v;
+    v.isObject = true;
+    v.isInt = false;
+    v.as.object = object;
+    return v;
+}
+
+struct SnapshotWriter {
+    VM *vm;
+    std::string body;
+
+    std::vector<Object *> objects;
+    std::unordered_map<Object *, uint32_t> ids;
+    std::vector<Upvalue *> upvalues;
+    std::unordered_map<Upvalue *, uint32_t> upvalueIds;
+    std::unordered_map<Object *, uint32_t> core;
+
+    template <typename T>
+    void put(T value) {
+        body.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void bytes(const char *data, size_t size) {
+        put<uint64_t>(size);
+        body.append(data, size);
+    }
+
+    void visit(Value v) {
+        if (v.isObject && ids.find(v.as.object) == ids.end()) {
+            ids[v.as.object] = objects.size();
+            objects.push_back(v.as.object);
+        }
+    }
+
+    void visit(const std::vector<Value> &values) {
+        for (const Value &v : values)
+            visit(v);
+    }
+
+    SnapshotKind kind(Object *object) {
+        ObjectClass *classObject = object->classObject;
+
+        if (core.find(object) != core.end())
+            return KIND_CORE;
+        if (classObject == vm->strClass || classObject == vm->stringViewClass)
+            return KIND_STRING;
+        if (classObject == vm->listClass)
+            return KIND_LIST;
+        if (classObject == vm->float64ArrayClass)
+            return KIND_FLOAT64_ARRAY;
+        if (classObject == vm->mapClass)
+            return KIND_MAP;
+        if (classObject == vm->functionClass && !static_cast<Function *>(object)->foreign)
+            return KIND_FUNCTION;
+        if (classObject == vm->closureClass)
+            return KIND_CLOSURE;
+        if (classObject == vm->sequenceClass)
+            return KIND_SEQUENCE;
+        if (classObject == vm->fileClass)
+            return KIND_FILE;
+        if (classObject == vm->coroutineClass)
+            abort("Cannot snapshot a coroutine.");
+
+        abort("Cannot snapshot this value.");
+        return KIND_CORE;
+    }
+
+    // Numbers as their bits, objects as their index.
+    void value(Value v) {
+        int64_t payload;
+
+        if (v.isObject)
+            payload = ids.at(v.as.object);
+        else
+            memcpy(&payload, &v.as, sizeof(payload));
+
+        put<int64_t>(payload);
+        put<uint8_t>(v.isObject);
+        put<uint8_t>(v.isInt);
+    }
+
+    void values(const std::vector<Value> &values) {
+        put<uint32_t>(values.size());
+        for (const Value &v : values)
+            value(v);
+    }
+
+    // Finds everything reachable, growing objects as it goes.
+    void collect() {
+        for (int i = 0; i < objects.size(); i++) {
+            Object *object = objects[i];
+
+            switch (kind(object)) {
+                case KIND_LIST: {
+                    List *list = static_cast<List *>(object);
+                    for (int j = 0; j < list->size; j++)
+                        visit(list->items[j]);
+                    break;
+                }
+
+                case KIND_MAP:
+                    for (auto &entry : static_cast<Map *>(object)->entries) {
+                        visit(objectValue(entry.key));
+                        visit(entry.value);
+                    }
+                    break;
+
+                case KIND_FUNCTION:
+                    visit(static_cast<Function *>(object)->constants);
+                    break;
+
+                case KIND_CLOSURE: {
+                    Closure *closure = static_cast<Closure *>(object);
+
+                    visit(objectValue(closure->function));
+
+                    for (Upvalue *upvalue : closure->upvalues) {
+                        if (upvalue->open)
+                            abort("Cannot snapshot a closure over a live variable.");
+
+                        if (upvalueIds.find(upvalue) == upvalueIds.end()) {
+                            upvalueIds[upvalue] = upvalues.size();
+                            upvalues.push_back(upvalue);
+                            visit(upvalue->closed);
+                        }
+                    }
+                    break;
+                }
+
+                case KIND_SEQUENCE: {
+                    Sequence *sequence = static_cast<Sequence *>(object);
+                    visit(sequence->list);
+
+                    for (auto &stage : sequence->stages)
+                        visit(stage.fn);
+
+                    if (sequence->file != nullptr)
+                        visit(objectValue(sequence->file));
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    void write(Object *object) {
+        switch (kind(object)) {
+            case KIND_STRING:
+                if (object->classObject == vm->stringViewClass) {
+                    StringView *view = static_cast<StringView *>(object);
+                    bytes(view->data, view->size);
+                } else {
+                    const std::string &s = static_cast<String *>(object)->value;
+                    bytes(s.data(), s.size());
+                }
+                break;
+
+            case KIND_LIST: {
+                List *list = static_cast<List *>(object);
+                for (int i = 0; i < list->size; i++)
+                    value(list->items[i]);
+                break;
+            }
+
+            case KIND_FLOAT64_ARRAY: {
+                Float64Array *array = static_cast<Float64Array *>(object);
+                body.append(reinterpret_cast<const char *>(array->items), array->size * sizeof(double));
+                break;
+            }
+
+            case KIND_MAP: {
+                Map *map = static_cast<Map *>(object);
+                put<uint32_t>(map->entries.size());
+
+                for (auto &entry : map->entries) {
+                    put<uint32_t>(ids.at(entry.key));
+                    value(entry.value);
+                }
+                break;
+            }
+
+            case KIND_FUNCTION: {
+                Function *fn = static_cast<Function *>(object);
+                bytes(reinterpret_cast<const char *>(fn->code.data()), fn->code.size());
+                values(fn->constants);
+
+                put<uint32_t>(fn->upvalues.size());
+                for (auto &info : fn->upvalues) {
+                    put<uint8_t>(info.isLocal);
+                    put<int32_t>(info.index);
+                }
+
+                put<int32_t>(fn->localCount);
+                put<int32_t>(fn->arity);
+                break;
+            }
+
+            case KIND_CLOSURE: {
+                Closure *closure = static_cast<Closure *>(object);
+                put<uint32_t>(ids.at(closure->function));
+
+                put<uint32_t>(closure->upvalues.size());
+                for (Upvalue *upvalue : closure->upvalues)
+                    put<uint32_t>(upvalueIds.at(upvalue));
+                break;
+            }
+
+            case KIND_SEQUENCE: {
+                Sequence *sequence = static_cast<Sequence *>(object);
+                value(sequence->list);
+                put<int64_t>(sequence->start);
+                put<int64_t>(sequence->end);
+
+                put<uint32_t>(sequence->stages.size());
+                for (auto &stage : sequence->stages) {
+                    put<uint8_t>(stage.kind);
+                    value(stage.fn);
+                    put<int64_t>(stage.count);
+                }
+
+                // 0 for no file, otherwise its index plus one.
+                put<uint32_t>(sequence->file != nullptr ? ids.at(sequence->file) + 1 : 0);
+                put<int64_t>(sequence->chunk);
+
+                put<int64_t>(sequence->position);
+                put<uint32_t>(sequence->taken.size());
+                for (int64_t taken : sequence->taken)
+                    put<int64_t>(taken);
+                put<uint8_t>(sequence->finished);
+                break;
+            }
+
+            case KIND_FILE: {
+                const std::string &path = static_cast<File *>(object)->path;
+                bytes(path.data(), path.size());
+                break;
+            }
+
+            case KIND_CORE:
+                break;
+        }
+    }
+
+    // What the loader needs to allocate object before filling it in: the
+    // size of a list or array, or the slot of a core global.
+    uint64_t length(Object *object) {
+        switch (kind(object)) {
+            case KIND_LIST: return static_cast<List *>(object)->size;
+            case KIND_FLOAT64_ARRAY: return static_cast<Float64Array *>(object)->size;
+            case KIND_CORE: return core.at(object);
+            default: return 0;
+        }
+    }
+};
+
+void VM::snapshot(const std::string &path) {
+    if (!pending || !frames.empty() || coroutine != nullptr || callbacks > 0)
+        abort("snapshot() must be called from top-level code.");
+
+    SnapshotWriter writer;
+    writer.vm = this;
+
+    const std::vector<Value> &coreValues = coreGlobalValues();
+    for (int i = 0; i < coreValues.size(); i++) {
+        if (coreValues[i].isObject)
+            writer.core[coreValues[i].as.object] = i;
+    }
+
+    writer.visit(memory);
+    writer.visit(stack);
+    writer.visit(compiler->constants);
+    writer.collect();
+
+    writer.put<uint32_t>(writer.objects.size());
+    for (Object *object : writer.objects) {
+        writer.put<uint8_t>(writer.kind(object));
+        writer.put<uint64_t>(writer.length(object));
+    }
+
+    for (Object *object : writer.objects)
+        writer.write(object);
+
+    writer.put<uint32_t>(writer.upvalues.size());
+    for (Upvalue *upvalue : writer.upvalues)
+        writer.value(upvalue->closed);
+
+    writer.bytes(reinterpret_cast<const char *>(program.data()), program.size());
+    writer.values(compiler->constants);
+    writer.put<uint64_t>(ip - program.data());
+
+    writer.values(memory);
+    writer.values(stack);
+
+    writer.put<int32_t>(compiler->varOffset);
+    writer.put<uint32_t>(compiler->symbolsTable.size());
+    for (auto &symbol : compiler->symbolsTable) {
+        writer.bytes(symbol.first.data(), symbol.first.size());
+        writer.put<int32_t>(symbol.second);
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.reserved = 0;
+    header.checksum = checksum(writer.body.data(), writer.body.size());
+    header.size = writer.body.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(writer.body.data(), writer.body.size());
+
+    if (!out)
+        abort("Cannot write " + path + ".");
+}
+
+struct SnapshotReader {
+    VM *vm;
+    const char *p;
+    const char *end;
+
+    std::vector<uint8_t> kinds;
+    std::vector<Object *> objects;
+    std::vector<Upvalue *> upvalues;
+    std::vector<std::pair<Map *, Map::Entry> > entries;
+
+    void corrupt() {
+        abort("Corrupt snapshot.");
+    }
+
+    void need(uint64_t size) {
+        if (size > (uint64_t) (end - p))
+            corrupt();
+    }
+
+    template <typename T>
+    T get() {
+        need(sizeof(T));
+        T value;
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return value;
+    }
+
+    // A count of items at least itemSize bytes each, checked against what
+    // is left so that a bad count cannot ask for a huge allocation.
+    uint32_t count(uint64_t itemSize) {
+        uint32_t n = get<uint32_t>();
+        need(n * itemSize);
+        return n;
+    }
+
+    std::string bytes() {
+        uint64_t size = get<uint64_t>();
+        need(size);
+        std::string out(p, size);
+        p += size;
+        return out;
+    }
+
+    Object *lookup(uint64_t index, SnapshotKind kind) {
+        if (index >= objects.size() || kinds[index] != kind)
+            corrupt();
+        return objects[index];
+    }
+
+    Value value() {
+        Value v;
+        int64_t payload = get<int64_t>();
+        v.isObject = get<uint8_t>() != 0;
+        v.isInt = get<uint8_t>() != 0;
+
+        if (v.isObject) {
+            if ((uint64_t) payload >= objects.size())
+                corrupt();
+            v.as.object = objects[payload];
+        } else {
+            memcpy(&v.as, &payload, sizeof(payload));
+        }
+
+        return v;
+    }
+
+    std::vector<Value> values() {
+        uint32_t n = count(10);
+        std::vector<Value> out(n);
+
+        for (uint32_t i = 0; i < n; i++)
+            out[i] = value();
+
+        return out;
+    }
+
+    void allocate() {
+        uint32_t n = count(9);
+        const std::vector<Value> &coreValues = coreGlobalValues();
+
+        std::vector<uint64_t> lengths(n);
+        kinds.resize(n);
+        objects.resize(n);
+
+        for (uint32_t i = 0; i < n; i++) {
+            kinds[i] = get<uint8_t>();
+            lengths[i] = get<uint64_t>();
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            switch (kinds[i]) {
+                case KIND_STRING: objects[i] = new String(vm, ""); break;
+                case KIND_LIST: objects[i] = new List(vm); break;
+                case KIND_MAP: objects[i] = new Map(vm); break;
+                case KIND_FUNCTION: objects[i] = new Function(vm); break;
+                case KIND_CLOSURE: objects[i] = new Closure(vm, nullptr); break;
+                case KIND_SEQUENCE: objects[i] = new Sequence(vm); break;
+                case KIND_FILE: objects[i] = new File(vm); break;
+
+                case KIND_FLOAT64_ARRAY:
+                    need(lengths[i] * sizeof(double));
+                    objects[i] = new Float64Array(vm, lengths[i]);
+                    break;
+
+                case KIND_CORE: {
+                    if (lengths[i] >= coreValues.size() || !coreValues[lengths[i]].isObject)
+                        corrupt();
+                    objects[i] = coreValues[lengths[i]].as.object;
+                    break;
+                }
+
+                default:
+                    corrupt();
+            }
+
+            if (kinds[i] == KIND_LIST) {
+                need(lengths[i] * 10);
+                static_cast<List *>(objects[i])->reserve(lengths[i]);
+            }
+        }
+
+        for (uint32_t i = 0; i < n; i++)
+            fill(i, lengths[i]);
+
+        for (auto &pending : entries) {
+            if (pending.first->find(pending.second.key->value) >= 0)
+                corrupt();
+            pending.first->put(pending.second.key, pending.second.value);
+        }
+    }
+
+    void fill(uint32_t i, uint64_t length) {
+        Object *object = objects[i];
+
+        switch (kinds[i]) {
+            case KIND_STRING:
+                static_cast<String *>(object)->value = bytes();
+                break;
+
+            case KIND_LIST: {
+                List *list = static_cast<List *>(object);
+                for (uint64_t j = 0; j < length; j++)
+                    list->add(value());
+                break;
+            }
+
+            case KIND_FLOAT64_ARRAY: {
+                Float64Array *array = static_cast<Float64Array *>(object);
+                need(length * sizeof(double));
+                memcpy(array->items, p, length * sizeof(double));
+                p += length * sizeof(double);
+                break;
+            }
+
+            case KIND_MAP: {
+                Map *map = static_cast<Map *>(object);
+                uint32_t n = count(14);
+
+                // Keys may not have been read yet, so entries go in once
+                // every object has been.
+                for (uint32_t j = 0; j < n; j++) {
+                    Map::Entry entry;
+                    entry.key = static_cast<String *>(lookup(get<uint32_t>(), KIND_STRING));
+                    entry.value = value();
+                    entries.push_back(std::make_pair(map, entry));
+                }
+                break;
+            }
+
+            case KIND_FUNCTION: {
+                Function *fn = static_cast<Function *>(object);
+                std::string code = bytes();
+                fn->code.assign(code.begin(), code.end());
+                fn->constants = values();
+
+                uint32_t n = count(5);
+                for (uint32_t j = 0; j < n; j++) {
+                    UpvalueInfo info;
+                    info.isLocal = get<uint8_t>() != 0;
+                    info.index = get<int32_t>();
+                    fn->upvalues.push_back(info);
+                }
+
+                fn->localCount = get<int32_t>();
+                fn->arity = get<int32_t>();
+
+                // Verified again on its first call, like any new function.
+                if (fn->code.empty())
+                    corrupt();
+                break;
+            }
+
+            case KIND_CLOSURE: {
+                Closure *closure = static_cast<Closure *>(object);
+                closure->function = static_cast<Function *>(lookup(get<uint32_t>(), KIND_FUNCTION));
+
+                uint32_t n = count(4);
+                closure->upvalues.resize(n);
+
+                // Upvalues come after the objects, so these are indices
+                // for now; restore() swaps them for pointers.
+                for (uint32_t j = 0; j < n; j++)
+                    closure->upvalues[j] = reinterpret_cast<Upvalue *>((uintptr_t) get<uint32_t>());
+                break;
+            }
+
+            case KIND_SEQUENCE: {
+                Sequence *sequence = static_cast<Sequence *>(object);
+                sequence->list = value();
+                sequence->start = get<int64_t>();
+                sequence->end = get<int64_t>();
+
+                uint32_t n = count(19);
+                for (uint32_t j = 0; j < n; j++) {
+                    Sequence::Stage stage;
+                    uint8_t kind = get<uint8_t>();
+                    if (kind > Sequence::Stage::TAKE)
+                        corrupt();
+
+                    stage.kind = (Sequence::Stage::Kind) kind;
+                    stage.fn = value();
+                    stage.count = get<int64_t>();
+                    sequence->stages.push_back(stage);
+                }
+
+                uint32_t file = get<uint32_t>();
+                if (file != 0)
+                    sequence->file = static_cast<File *>(lookup(file - 1, KIND_FILE));
+                sequence->chunk = get<int64_t>();
+
+                sequence->position = get<int64_t>();
+                uint32_t taken = count(8);
+                for (uint32_t j = 0; j < taken; j++)
+                    sequence->taken.push_back(get<int64_t>());
+                sequence->finished = get<uint8_t>() != 0;
+
+                if (sequence->list.isObject && sequence->list.as.object->classObject != vm->listClass)
+                    corrupt();
+                if (!sequence->taken.empty() && sequence->taken.size() != sequence->stages.size())
+                    corrupt();
+                break;
+            }
+
+            case KIND_FILE: {
+                // Files are mapped again by path; their contents are not kept.
+                File *file = static_cast<File *>(object);
+                File *opened = openFile(vm, bytes());
+                *file = *opened;
+                delete opened;
+                break;
+            }
+
+            case KIND_CORE:
+                break;
+        }
+    }
+};
+
+bool VM::restore(const std::string &path, std::string *error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size < sizeof(SnapshotHeader)) {
+        if (fd >= 0)
+            close(fd);
+        if (error != nullptr)
+            *error = "Cannot open " + path + ".";
+        return false;
+    }
+
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        if (error != nullptr)
+            *error = "Cannot map " + path + ".";
+        return false;
+    }
+
+    const char *start = static_cast<const char *>(data);
+
+    try {
+        SnapshotHeader header;
+        memcpy(&header, start, sizeof(header));
+
+        if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION)
+            abort(path + " is not a snapshot.");
+
+        const char *body = start + sizeof(header);
+        if (header.size != info.st_size - sizeof(header) || checksum(body, header.size) != header.checksum)
+            abort("Corrupt snapshot.");
+
+        SnapshotReader reader;
+        reader.vm = this;
+        reader.p = body;
+        reader.end = body + header.size;
+
+        reader.allocate();
+
+        uint32_t count = reader.count(10);
+        for (uint32_t i = 0; i < count; i++) {
+            Upvalue *upvalue = new Upvalue();
+            upvalue->slot = 0;
+            upvalue->open = false;
+            upvalue->closed = reader.value();
+            reader.upvalues.push_back(upvalue);
+        }
+
+        for (int i = 0; i < reader.objects.size(); i++) {
+            if (reader.kinds[i] != KIND_CLOSURE)
+                continue;
+
+            Closure *closure = static_cast<Closure *>(reader.objects[i]);
+            if (closure->upvalues.size() != closure->function->upvalues.size())
+                reader.corrupt();
+
+            for (Upvalue *&upvalue : closure->upvalues) {
+                uintptr_t index = reinterpret_cast<uintptr_t>(upvalue);
+                if (index >= reader.upvalues.size())
+                    reader.corrupt();
+                upvalue = reader.upvalues[index];
+            }
+        }
+
+        std::string code = reader.bytes();
+        std::vector<Value> topConstants = reader.values();
+        uint64_t offset = reader.get<uint64_t>();
+        std::vector<Value> globals = reader.values();
+        std::vector<Value> saved = reader.values();
+        int varOffset = reader.get<int32_t>();
+
+        std::map<std::string, int> symbols;
+        uint32_t symbolCount = reader.count(12);
+        for (uint32_t i = 0; i < symbolCount; i++) {
+            std::string name = reader.bytes();
+            symbols[name] = reader.get<int32_t>();
+        }
+
+        // The snapshot was taken by a call, so there is an instruction
+        // before offset, and at least a RETURN after it.
+        if (offset < 2 || offset >= code.size() || varOffset < 0 || globals.size() < varOffset)
+            reader.corrupt();
+
+        std::string invalid;
+        std::vector<uint8_t> restored(code.begin(), code.end());
+        if (!verifyCode(this, restored, topConstants, varOffset, 0, 0, false, &invalid))
+            abort("Invalid bytecode: " + invalid);
+
+        program = restored;
+        compiler->constants = topConstants;
+        compiler->varOffset = varOffset;
+        compiler->symbolsTable = symbols;
+
+        memory = globals;
+        stack = saved;
+        frames.clear();
+        openUpvalues.clear();
+        memoryOffset = 0;
+        closure = nullptr;
+        function = nullptr;
+        coroutine = nullptr;
+
+        ip = program.data() + offset;
+        constants = compiler->constants.data();
+        pending = true;
+
+        // What snapshot() returns in the process that resumes.
+        push(newInt(1));
+    } catch (ScriptError &e) {
+        munmap(data, info.st_size);
+
+        if (error != nullptr)
+            *error = e.message;
+        return false;
+    }
+
+    munmap(data, info.st_size);
+    return true;
+}
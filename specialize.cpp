@@ -0,0 +1,250 @@
+#include "value.hpp"
+
+// Types tracked for each stack entry: either proven to be a number, or not.
+typedef std::vector<bool> StackTypes;
+
+struct Inference {
+    std::vector<uint8_t> &code;
+    const std::vector<Value> &constants;
+
+    std::map<int, uint8_t> operators;
+
+    std::vector<StackTypes> states;
+    std::vector<bool> reached;
+
+    std::vector<bool> numeric;
+    std::vector<bool> written;
+
+    Inference(std::vector<uint8_t> &code, const std::vector<Value> &constants) :
+        code(code),
+        constants(constants)
+    {
+    }
+
+    void merge(int pc, const StackTypes &types, std::vector<int> &work) {
+        if (pc >= code.size())
+            return;
+
+        if (!reached[pc]) {
+            reached[pc] = true;
+            states[pc] = types;
+            work.push_back(pc);
+            return;
+        }
+
+        // Line the two stacks up from the top; anything below the shorter
+        // one is forgotten, and an entry stays numeric only if both agree.
+        StackTypes &current = states[pc];
+        int depth = std::min(current.size(), types.size());
+
+        StackTypes merged(depth);
+        for (int i = 0; i < depth; i++) {
+            merged[depth - 1 - i] = current[current.size() - 1 - i] &&
+                                    types[types.size() - 1 - i];
+        }
+
+        if (merged != current) {
+            current = merged;
+            work.push_back(pc);
+        }
+    }
+
+    static bool pop(StackTypes &types) {
+        if (types.empty())
+            return false;
+
+        bool top = types.back();
+        types.pop_back();
+        return top;
+    }
+
+    // Runs the dataflow once with the current guess of which locals are
+    // numeric. Returns true if that guess had to be weakened.
+    bool run() {
+        states.assign(code.size(), StackTypes());
+        reached.assign(code.size(), false);
+        written.assign(numeric.size(), false);
+
+        bool changed = false;
+        std::vector<int> work;
+        merge(0, StackTypes(), work);
+
+        while (!work.empty()) {
+            int pc = work.back();
+            work.pop_back();
+
+            StackTypes types = states[pc];
+            uint8_t op = code[pc];
+            int next = pc + instructionLength(op);
+
+            switch (op) {
+                case MOVB:
+                    types.push_back(!constants[code[pc + 1]].isObject);
+                    break;
+
+                case JUMP:
+                    merge(pc + 1 + code[pc + 1], types, work);
+                    continue;
+
+                case JUMP_BACK:
+                    merge(pc + 1 - code[pc + 1], types, work);
+                    continue;
+
+                case JEQ:
+                    pop(types);
+                    merge(pc + 1 + code[pc + 1], types, work);
+                    break;
+
+                case ITER_NEXT:
+                    merge(pc + 2 + code[pc + 2], types, work);
+                    types.push_back(false);
+                    break;
+
+                case MEM:
+                    types.push_back(numeric[code[pc + 1]]);
+                    break;
+
+                case MEMSET: {
+                    int slot = code[pc + 1];
+                    written[slot] = true;
+
+                    if (!pop(types) && numeric[slot]) {
+                        numeric[slot] = false;
+                        changed = true;
+                    }
+                    break;
+                }
+
+                case ITER_INIT:
+                case SET_UPVAL:
+                case POP:
+                case DEL:
+                case YIELD:
+                    pop(types);
+                    break;
+
+                case RESUME:
+                    pop(types);
+                    types.push_back(false);
+                    break;
+
+                case GLOBAL:
+                case GET_UPVAL:
+                case CLOSURE:
+                    types.push_back(false);
+                    break;
+
+                case INDEX_GET:
+                    pop(types);
+                    pop(types);
+                    types.push_back(false);
+                    break;
+
+                case INDEX_SET:
+                    pop(types);
+                    pop(types);
+                    pop(types);
+                    break;
+
+                case NEW_LIST:
+                    for (int i = 0; i < code[pc + 1]; i++)
+                        pop(types);
+                    types.push_back(false);
+                    break;
+
+                case ADD:
+                case SUB:
+                case MUL:
+                case DIV:
+                case LT:
+                case GT:
+                case LTEQ:
+                case GTEQ:
+                    pop(types);
+                    pop(types);
+                    types.push_back(true);
+                    break;
+
+                case CALL: {
+                    int depth = code[pc + 2];
+                    bool numbers = true;
+
+                    for (int i = 0; i < depth + 1; i++)
+                        numbers = pop(types) && numbers;
+
+                    bool arithmetic = depth == 1 && operators.count(code[pc + 1]);
+                    types.push_back(arithmetic && numbers);
+                    break;
+                }
+
+                case CALL_FUNC:
+                case TAIL_CALL:
+                    for (int i = 0; i < code[pc + 1] + 1; i++)
+                        pop(types);
+                    types.push_back(false);
+                    break;
+
+                case RETURN:
+                    continue;
+            }
+
+            merge(next, types, work);
+        }
+
+        // A local no code here ever stores to keeps whatever it held before.
+        for (int slot = 0; slot < numeric.size(); slot++) {
+            if (!written[slot] && numeric[slot]) {
+                numeric[slot] = false;
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+};
+
+int specializeNumeric(VM *vm, std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                      int localCount, const std::set<int> &unknown, int *candidates) {
+    Inference inference(code, constants);
+
+    Compiler *compiler = vm->compiler;
+    inference.operators[compiler->findSymbol("+")] = ADD;
+    inference.operators[compiler->findSymbol("-")] = SUB;
+    inference.operators[compiler->findSymbol("*")] = MUL;
+    inference.operators[compiler->findSymbol("/")] = DIV;
+    inference.operators[compiler->findSymbol("<")] = LT;
+    inference.operators[compiler->findSymbol(">")] = GT;
+    inference.operators[compiler->findSymbol("<=")] = LTEQ;
+    inference.operators[compiler->findSymbol(">=")] = GTEQ;
+
+    inference.numeric.assign(localCount, true);
+    for (int slot : unknown) {
+        if (slot < localCount)
+            inference.numeric[slot] = false;
+    }
+
+    while (inference.run()) {
+    }
+
+    int specialized = 0;
+
+    for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+        if (code[pc] != CALL || code[pc + 2] != 1)
+            continue;
+
+        auto op = inference.operators.find(code[pc + 1]);
+        if (op == inference.operators.end())
+            continue;
+
+        (*candidates)++;
+
+        StackTypes &types = inference.states[pc];
+        if (inference.reached[pc] && types.size() >= 2 &&
+            types[types.size() - 1] && types[types.size() - 2]) {
+            code[pc] = op->second;
+            specialized++;
+        }
+    }
+
+    return specialized;
+}
@@ -1,15 +1,155 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
 #include "value.hpp"
 
 Value newNum(double n) {
     Value v;
     v.isObject = false;
+    v.isInt = false;
     v.as.num = n;
 
     return v;
 }
 
+Value newInt(int64_t n) {
+    Value v;
+    v.isObject = false;
+    v.isInt = true;
+    v.as.integer = n;
+
+    return v;
+}
+
+double asNum(Value v) {
+    return v.isInt ? v.as.integer : v.as.num;
+}
+
+int64_t asInt(Value v) {
+    return v.isInt ? v.as.integer : v.as.num;
+}
+
+int64_t toInteger(Value v) {
+    if (v.isObject)
+        abort("Number expected.");
+    if (v.isInt)
+        return v.as.integer;
+
+    double n = v.as.num;
+    if (n != floor(n))
+        abort("Whole number expected.");
+    if (!(n >= -9.2e18 && n <= 9.2e18))
+        abort("Number out of range.");
+
+    return n;
+}
+
+int toIndex(Value v, int size) {
+    int64_t index = toInteger(v);
+
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size)
+        abort("Index out of bounds.");
+
+    return index;
+}
+
+static Value intResult(int64_t n) {
+    if (n < -MAX_INT || n > MAX_INT)
+        return newNum(n);
+
+    return newInt(n);
+}
+
+// Rounds |n| to millionths in integer arithmetic when that must agree with
+// %f: when n is a whole number, or when it is small enough that the error of
+// scaling it is well clear of a rounding tie. Anything else, NaN and the
+// infinities included, goes to snprintf.
+void writeNum(std::string &out, double n) {
+    double magnitude = fabs(n);
+
+    if (magnitude < 9e9) {
+        double scaled = magnitude * 1e6;
+        double whole = floor(scaled);
+        double fraction = scaled - whole;
+
+        if (magnitude == floor(magnitude) ||
+            (scaled < 4398046511104.0 && fabs(fraction - 0.5) > 1.0 / 1024)) {
+            int64_t micros = (int64_t) whole + (fraction > 0.5);
+            int64_t units = micros / 1000000;
+            int64_t decimals = micros % 1000000;
+
+            char digits[32];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+
+            for (int i = 0; i < 6; i++) {
+                *--p = '0' + decimals % 10;
+                decimals /= 10;
+            }
+            *--p = '.';
+
+            do {
+                *--p = '0' + units % 10;
+                units /= 10;
+            } while (units > 0);
+
+            if (signbit(n))
+                *--p = '-';
+
+            out.append(p, end - p);
+            return;
+        }
+    }
+
+    char text[512];
+    int length = snprintf(text, sizeof(text), "%f", n);
+    out.append(text, length);
+}
+
+Value numAdd(Value a, Value b) {
+    if (a.isInt && b.isInt)
+        return intResult(a.as.integer + b.as.integer);
+
+    return newNum(asNum(a) + asNum(b));
+}
+
+Value numSub(Value a, Value b) {
+    if (a.isInt && b.isInt)
+        return intResult(a.as.integer - b.as.integer);
+
+    return newNum(asNum(a) - asNum(b));
+}
+
+Value numMul(Value a, Value b) {
+    int64_t result;
+
+    // A zero product with a negative operand is -0 as a double.
+    if (a.isInt && b.isInt &&
+        !__builtin_mul_overflow(a.as.integer, b.as.integer, &result) &&
+        (result != 0 || (a.as.integer >= 0 && b.as.integer >= 0)))
+        return intResult(result);
+
+    return newNum(asNum(a) * asNum(b));
+}
+
+Value numDiv(Value a, Value b) {
+    if (a.isInt && b.isInt && b.as.integer != 0 &&
+        a.as.integer % b.as.integer == 0 &&
+        (a.as.integer != 0 || b.as.integer > 0))
+        return newInt(a.as.integer / b.as.integer);
+
+    return newNum(asNum(a) / asNum(b));
+}
+
 String::String(VM* vm, std::string value) :
-    value(value)
+    value(std::move(value))
 {
     classObject = vm->strClass;
 }
@@ -17,7 +157,8 @@ String::String(VM* vm, std::string value) :
 Value newString(VM* vm, std::string s) {
     Value v;
     v.isObject = true;
-    v.as.object = new String(vm, s);
+    v.isInt = false;
+    v.as.object = new String(vm, std::move(s));
 
     return v;
 }
@@ -26,43 +167,384 @@ List::List(VM *vm) {
     classObject = vm->listClass;
 
     size = 0;
-    capacity = 8;
-    items = new Value[capacity];
+    capacity = 0;
+    items = nullptr;
 }
 
 void List::add(Value v) {
-    if (size >= capacity) {
-        capacity *= 2;
-        Value *newItems = new Value[capacity];
+    if (size >= capacity)
+        grow(size + 1);
 
-        for (int i = 0; i < size; i++) {
-            newItems[i] = items[i];
-        }
+    items[size++] = v;
+}
+
+void List::addAll(Value *values, int count) {
+    // values may point into items (a list appended to itself), which grow can move.
+    bool aliased = values >= items && values < items + size;
+    int offset = aliased ? values - items : 0;
+
+    grow(size + count);
+
+    if (aliased)
+        values = items + offset;
 
-        delete []items;
-        items = newItems;
+    memcpy(items + size, values, count * sizeof(Value));
+    size += count;
+}
+
+void List::insert(int index, Value v) {
+    grow(size + 1);
+
+    memmove(items + index + 1, items + index, (size - index) * sizeof(Value));
+    items[index] = v;
+    size++;
+}
+
+Value List::remove(int index) {
+    Value v = items[index];
+
+    memmove(items + index, items + index + 1, (size - index - 1) * sizeof(Value));
+    size--;
+
+    // Give memory back once the list is only a quarter full. Halving rather
+    // than fitting exactly leaves room so add/remove cycles don't thrash.
+    if (capacity > 8 && size < capacity / 4)
+        setCapacity(capacity / 2);
+
+    return v;
+}
+
+void List::clear() {
+    // Capacity is kept so a list that is rebuilt doesn't regrow from scratch.
+    size = 0;
+}
+
+void List::reserve(int count) {
+    if (count > capacity)
+        setCapacity(count);
+}
+
+void List::shrink() {
+    if (size < capacity)
+        setCapacity(size);
+}
+
+void List::grow(int count) {
+    if (count <= capacity)
+        return;
+
+    int newCapacity = capacity < 8 ? 8 : capacity;
+    while (newCapacity < count)
+        newCapacity *= 2;
+
+    setCapacity(newCapacity);
+}
+
+void List::setCapacity(int count) {
+    if (count == 0) {
+        free(items);
+        items = nullptr;
+    } else {
+        items = static_cast<Value *>(realloc(items, count * sizeof(Value)));
     }
 
-    items[size++] = v;
+    capacity = count;
 }
 
 Value newList(VM *vm) {
     Value v;
     v.isObject = true;
+    v.isInt = false;
     v.as.object = new List(vm);
 
     return v;
 }
 
+Float64Array::Float64Array(VM *vm, int64_t size) {
+    classObject = vm->float64ArrayClass;
+
+    if (size < 0)
+        abort("Size must not be negative.");
+    if (size > INT_MAX)
+        abort("Size is too large.");
+
+    this->size = size;
+    items = new (std::nothrow) double[size]();
+
+    if (items == nullptr)
+        abort("Not enough memory for " + std::to_string(size) + " numbers.");
+}
+
+Value newFloat64Array(VM *vm, int64_t size) {
+    Value v;
+    v.isObject = true;
+    v.isInt = false;
+    v.as.object = new Float64Array(vm, size);
+
+    return v;
+}
+
+Map::Map(VM *vm) {
+    classObject = vm->mapClass;
+}
+
+int Map::find(const std::string &key) const {
+    if (entries.size() > INDEXED) {
+        auto it = index.find(key);
+        return it == index.end() ? -1 : it->second;
+    }
+
+    for (int i = 0; i < entries.size(); i++) {
+        if (entries[i].key->value == key)
+            return i;
+    }
+
+    return -1;
+}
+
+void Map::put(String *key, Value value) {
+    entries.push_back({key, value});
+
+    if (entries.size() == INDEXED + 1)
+        reindex();
+    else if (entries.size() > INDEXED + 1)
+        index[key->value] = entries.size() - 1;
+}
+
+void Map::reindex() {
+    index.clear();
+
+    if (entries.size() > INDEXED) {
+        for (int i = 0; i < entries.size(); i++)
+            index[entries[i].key->value] = i;
+    }
+}
+
+// The text of a String key, or of a view copied into scratch.
+static const std::string &keyText(VM *vm, Value key, std::string &scratch) {
+    if (key.isObject && key.as.object->classObject == vm->strClass)
+        return AS(key, String)->value;
+
+    if (key.isObject && key.as.object->classObject == vm->stringViewClass) {
+        scratch.assign(AS(key, StringView)->data, AS(key, StringView)->size);
+        return scratch;
+    }
+
+    abort("String key expected.");
+    return scratch;
+}
+
+Value *Map::get(VM *vm, Value key) {
+    std::string scratch;
+    int i = find(keyText(vm, key, scratch));
+    return i < 0 ? nullptr : &entries[i].value;
+}
+
+void Map::set(VM *vm, Value key, Value value) {
+    std::string scratch;
+    int i = find(keyText(vm, key, scratch));
+
+    if (i >= 0)
+        entries[i].value = retain(vm, value);
+    else
+        put(AS(retain(vm, key), String), retain(vm, value));
+}
+
+bool Map::remove(VM *vm, Value key, Value *removed) {
+    std::string scratch;
+    int i = find(keyText(vm, key, scratch));
+
+    if (i < 0)
+        return false;
+
+    *removed = entries[i].value;
+    entries.erase(entries.begin() + i);
+    reindex();
+    return true;
+}
+
+Value newMap(VM *vm) {
+    Value v;
+    v.isObject = true;
+    v.isInt = false;
+    v.as.object = new Map(vm);
+
+    return v;
+}
+
 Function::Function(VM *vm) :
-    foreign(false)
+    Function(vm->functionClass)
+{
+}
+
+Function::Function(ObjectClass *classObject) :
+    localCount(0),
+    arity(0),
+    foreign(false),
+    body(nullptr),
+    verified(false),
+    calls(0),
+    loops(0),
+    native(nullptr)
 {
-    classObject = vm->functionClass;
+    this->classObject = classObject;
+}
+
+Closure::Closure(VM *vm, Function *function) :
+    function(function)
+{
+    classObject = vm->closureClass;
+}
+
+Coroutine::Coroutine(VM *vm, Value callee) :
+    state(NEW),
+    callee(callee),
+    suspended(nullptr, nullptr, nullptr, nullptr, 0),
+    frameBase(0),
+    stackBase(0),
+    memoryBase(0),
+    resumer(nullptr)
+{
+    classObject = vm->coroutineClass;
+}
+
+Sequence::Sequence(VM *vm) :
+    start(0),
+    end(0),
+    file(nullptr),
+    chunk(0),
+    view(nullptr),
+    position(0),
+    finished(false)
+{
+    classObject = vm->sequenceClass;
+    list.isObject = false;
+}
+
+Sequence *Sequence::then(VM *vm, Stage stage) {
+    Sequence *out = new Sequence(vm);
+    out->list = list;
+    out->start = start;
+    out->end = end;
+    out->file = file;
+    out->chunk = chunk;
+    out->stages = stages;
+    out->stages.push_back(stage);
+    return out;
+}
+
+Sequence *Sequence::cursor(VM *vm) {
+    Sequence *out = new Sequence(vm);
+    out->list = list;
+    out->start = start;
+    out->end = end;
+    out->file = file;
+    out->chunk = chunk;
+    out->stages = stages;
+    out->position = start;
+    out->taken.assign(stages.size(), 0);
+
+    for (auto &stage : stages) {
+        if (stage.kind == Stage::TAKE && stage.count <= 0)
+            out->finished = true;
+    }
+
+    return out;
+}
+
+bool Sequence::next(VM *vm, Value *out) {
+    while (!finished) {
+        Value value;
+
+        if (file != nullptr) {
+            if (position >= file->size)
+                break;
+
+            const char *begin = file->data + position;
+            int64_t left = file->size - position;
+            int64_t length;
+
+            if (chunk > 0) {
+                length = std::min(chunk, left);
+                position += length;
+            } else {
+                const char *newline = static_cast<const char *>(memchr(begin, '\n', left));
+                length = newline != nullptr ? newline - begin : left;
+                position += length + 1;
+
+                if (length > 0 && begin[length - 1] == '\r')
+                    length--;
+            }
+
+            if (view == nullptr)
+                view = new StringView(vm);
+
+            view->data = begin;
+            view->size = length;
+
+            value.isObject = true;
+            value.isInt = false;
+            value.as.object = view;
+        } else if (list.isObject) {
+            List *items = AS(list, List);
+            if (position >= items->size)
+                break;
+
+            value = items->items[position++];
+        } else {
+            if (position >= end)
+                break;
+
+            value = newInt(position++);
+        }
+
+        bool kept = true;
+
+        for (int i = 0; i < stages.size() && kept; i++) {
+            Stage &stage = stages[i];
+
+            switch (stage.kind) {
+                case Stage::MAP:
+                    value = vm->call(stage.fn, &value, 1);
+                    break;
+
+                case Stage::FILTER: {
+                    Value keep = vm->call(stage.fn, &value, 1);
+                    kept = keep.isObject || (keep.isInt ? keep.as.integer != 0 : keep.as.num != 0);
+                    break;
+                }
+
+                case Stage::TAKE:
+                    // The last element a take lets through ends the pass,
+                    // so nothing more is pulled from the source.
+                    if (++taken[i] == stage.count)
+                        finished = true;
+                    break;
+            }
+        }
+
+        if (kept) {
+            *out = value;
+            return true;
+        }
+    }
+
+    finished = true;
+    return false;
+}
+
+Value retain(VM *vm, Value v) {
+    if (!v.isObject || v.as.object->classObject != vm->stringViewClass)
+        return v;
+
+    StringView *view = AS(v, StringView);
+    return newString(vm, std::string(view->data, view->size));
 }
 
 Value newFunction(VM *vm) {
     Value v;
     v.isObject = true;
+    v.isInt = false;
     v.as.object = new Function(vm);
 
     return v;
@@ -4,6 +4,11 @@
 #include <string>
 #include <vector>
 #include <stack>
+#include <set>
+#include <functional>
+#include <bitset>
+#include <ostream>
+#include <unordered_map>
 
 #define AS(value, type) static_cast<type *>(value.as.object)
 
@@ -15,6 +20,43 @@ class VM;
 
 std::string valueToStr(VM *vm, Value v);
 
+// Appends v as print shows it to out, nested lists included, without
+// building strings for the parts.
+void writeValue(VM *vm, std::string &out, Value v);
+
+// Appends n formatted as printf's %f would.
+void writeNum(std::string &out, double n);
+
+// What a VM prints. It collects in buffer and goes to stdout in one write
+// when the buffer fills, when a run ends or stops, and at flush().
+struct Output {
+    static const size_t LIMIT = 1 << 16;
+
+    std::string buffer;
+
+    void flushIfFull() {
+        if (buffer.size() >= LIMIT)
+            flush();
+    }
+
+    void flush();
+
+    ~Output() {
+        flush();
+    }
+};
+
+// What abort() throws. VM::run catches it, so an error ends the script
+// that raised it rather than the process.
+struct ScriptError {
+    std::string message;
+};
+
+void abort(std::string err);
+
+// Prints err the way errors are reported to the user.
+void error(std::string err);
+
 enum ObjectType
 {
     STRING,
@@ -41,33 +83,283 @@ struct List : public Object {
     int size;
 
     List(VM *vm);
+
     void add(Value v);
+    void addAll(Value *values, int count);
+    void insert(int index, Value v);
+    Value remove(int index);
+    void clear();
+
+    void reserve(int count);
+    void shrink();
+
+private:
+    void grow(int count);
+    void setCapacity(int count);
+};
+
+struct Float64Array : public Object {
+    double *items;
+
+    int size;
+
+    // Aborts unless 0 <= size <= INT_MAX and the items can be allocated.
+    Float64Array(VM *vm, int64_t size);
 };
 
+// Where a closure finds a captured variable when it is created: a local
+// of the enclosing function, or one of the enclosing closure's upvalues.
+struct UpvalueInfo {
+    bool isLocal;
+    int index;
+};
+
+typedef void (*Native)(VM *vm, Value *args);
+
 struct Function : public Object {
     std::vector<uint8_t> code;
     std::vector<Value> constants;
+    std::vector<UpvalueInfo> upvalues;
 
     int localCount;
+    int arity;
 
     bool foreign;
+    Native body;
+    // Set once the verifier has accepted code; the VM runs only verified
+    // code, and trusts its operands and stack use from then on.
+    bool verified;
+
+    // Call and loop back-edge counts, and the native code the JIT produced
+    // once either grew hot. entries maps loop headers to OSR entry points.
+    int calls;
+    int loops;
+    void (*native)(VM *vm);
+    std::map<int, void (*)(VM *vm)> entries;
 
     Function(VM *vm);
+    explicit Function(ObjectClass *classObject);
 };
 
 struct Value {
     union {
         double num;
+        int64_t integer;
         Object *object;
     } as;
     bool isObject;
+    bool isInt;
+};
+
+// Integers stay exact only while a double could hold them too, so the
+// choice of representation never changes a result.
+const int64_t MAX_INT = 1LL << 53;
+
+// Calls native code may have nested on the C++ stack. Deeper calls are
+// interpreted in place, so deep recursion can't overflow the stack.
+const int MAX_NATIVE_DEPTH = 1000;
+
+// A captured variable. While its frame is live it stays in VM::memory at
+// slot; once the frame returns the value moves into closed.
+struct Upvalue {
+    int slot;
+    bool open;
+    Value closed;
+};
+
+struct Closure : public Object {
+    Function *function;
+    std::vector<Upvalue *> upvalues;
+
+    Closure(VM *vm, Function *function);
+};
+
+// String keys to values, in the order keys were first set, so a map prints
+// and converts to JSON the way it was built. Small maps are searched in
+// place; larger ones also keep a hash index.
+struct Map : public Object {
+    struct Entry {
+        String *key;
+        Value value;
+    };
+
+    std::vector<Entry> entries;
+
+    Map(VM *vm);
+
+    // Index of the entry for key, or -1.
+    int find(const std::string &key) const;
+
+    // Appends an entry; key must not be in the map yet.
+    void put(String *key, Value value);
+
+    // Keys may be Strings or views; anything else is an error.
+    Value *get(VM *vm, Value key);
+    void set(VM *vm, Value key, Value value);
+    bool remove(VM *vm, Value key, Value *removed);
+
+private:
+    static const int INDEXED = 8;
+
+    std::unordered_map<std::string, int> index;
+
+    void reindex();
+};
+
+// A file mapped read-only into memory. The mapping lives as long as the
+// process, so views into it never dangle.
+struct File : public Object {
+    const char *data;
+    int64_t size;
+    std::string path;
+
+    File(VM *vm);
+};
+
+// Opens and maps path; aborts if it can't be read.
+File *openFile(VM *vm, const std::string &path);
+
+// Bytes of a mapped file used as a string without copying them. Line and
+// chunk iterators move one view along the file, so a view only holds its
+// line until the next is pulled. Only the loop variable takes a view as
+// it is; retain() copies it into every other variable, upvalue, list and
+// map it is stored in. Views belong to their cursor and are never deleted.
+struct StringView : public Object {
+    const char *data;
+    int64_t size;
+
+    StringView(VM *vm);
+};
+
+// v, or a String copy of it if it is a view.
+Value retain(VM *vm, Value v);
+
+// A lazy pipeline: a source, either a list, a range of integers or the
+// lines or chunks of a file, and
+// stages applied element by element in a single pass when a terminal
+// operation or a for loop pulls from it. Adding a stage copies the
+// pipeline, never the elements.
+struct Sequence : public Object {
+    struct Stage {
+        enum Kind {
+            MAP,
+            FILTER,
+            TAKE,
+        };
+
+        Kind kind;
+        Value fn;
+        int64_t count;
+    };
+
+    Value list;
+    int64_t start;
+    int64_t end;
+    std::vector<Stage> stages;
+
+    // For a file source, the size of its chunks, or 0 for lines, and the
+    // view a cursor hands out for each of them.
+    File *file;
+    int64_t chunk;
+    StringView *view;
+
+    // Where a cursor has got to, and how many elements each take let
+    // through so far.
+    int64_t position;
+    std::vector<int64_t> taken;
+    bool finished;
+
+    Sequence(VM *vm);
+
+    // A new sequence with stage appended.
+    Sequence *then(VM *vm, Stage stage);
+
+    // A fresh cursor over the same pipeline.
+    Sequence *cursor(VM *vm);
+
+    // Pulls the next element that makes it through every stage into out;
+    // false once the sequence is exhausted.
+    bool next(VM *vm, Value *out);
 };
 
 Value newNum(double n);
+Value newInt(int64_t n);
 Value newString(VM* vm, std::string s);
 Value newList(VM *vm);
+Value newFloat64Array(VM *vm, int64_t size);
+Value newMap(VM *vm);
 Value newFunction(VM *vm);
 
+double asNum(Value v);
+int64_t asInt(Value v);
+
+// v as a whole number for an index or a count; aborts if it is an object,
+// has a fraction or is beyond what an int64_t holds.
+int64_t toInteger(Value v);
+
+// v as an index into size items, counting back from the end when negative;
+// aborts unless it lands on one of them.
+int toIndex(Value v, int size);
+
+Value numAdd(Value a, Value b);
+Value numSub(Value a, Value b);
+Value numMul(Value a, Value b);
+Value numDiv(Value a, Value b);
+
+enum Instruction {
+    MOVB,
+
+    JUMP,
+    JUMP_BACK,
+    JEQ,
+
+    ITER_INIT,
+    ITER_NEXT,
+
+    INDEX_GET,
+    INDEX_SET,
+
+    NEW_LIST,
+
+    MEM,
+    MEMSET,
+
+    GLOBAL,
+
+    GET_UPVAL,
+    SET_UPVAL,
+    CLOSURE,
+
+    POP,
+
+    // Numeric operators proven by specializeNumeric; they keep CALL's two
+    // operand bytes so they can be patched in place.
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    LT,
+    GT,
+    LTEQ,
+    GTEQ,
+
+    CALL,
+    CALL_FUNC,
+    TAIL_CALL,
+
+    DEL,
+
+    RETURN,
+
+    // Suspends the running coroutine, handing the popped value to whoever
+    // resumed it, and runs a popped coroutine until it yields or returns.
+    YIELD,
+    RESUME,
+};
+
+// Bytes taken by an instruction, including its operands.
+int instructionLength(uint8_t op);
+
 enum TokenType {
     TOKEN_EMPTY,
 
@@ -108,6 +400,8 @@ enum TokenType {
     TOKEN_ELSE,
 
     TOKEN_WHILE,
+    TOKEN_FOR,
+    TOKEN_IN,
 
     TOKEN_FUNCTION,
     TOKEN_CLASS,
@@ -116,6 +410,9 @@ enum TokenType {
     TOKEN_LINE,
 
     TOKEN_RETURN,
+
+    TOKEN_YIELD,
+    TOKEN_RESUME,
 };
 
 struct Token {
@@ -140,6 +437,21 @@ class Compiler {
     std::map<std::string, int> vars;
     std::vector<uint8_t> code;
 
+    int lastCall;
+    int arity;
+
+    std::map<int, Function *> functionVars;
+    std::set<int> captured;
+
+    std::vector<UpvalueInfo> upvalues;
+
+    // Jump offsets are a single byte. overflowed is set when one would
+    // not fit; inlinedCalls counts calls inlined so far, and noInline
+    // turns inlining off while a statement is compiled again without it.
+    bool overflowed;
+    int inlinedCalls;
+    int noInline;
+
     void consume();
     void match(TokenType type);
 
@@ -148,19 +460,30 @@ class Compiler {
     bool isAddop(TokenType type);
     bool isRelop(TokenType type);
 
+    void branchStatement();
+    uint8_t jumpOffset(int distance);
     void ifBlock();
     void whileBlock();
+    void forBlock();
     void arguments();
     void createFunction();
     void classStatement();
     void deleteStatement();
     void returnStatement();
+    void yieldStatement();
     void statement();
     void function();
+    Function *inlineCandidate(std::string name);
+    bool canInline(Function *fn);
+    void inlineFunction(Function *fn);
     void block();
     void expression();
     void assignment();
+    bool isIndexAssignment();
+    void indexAssignment();
+    void index();
 
+    void getVar(std::string name);
     void setVar(std::string name);
 
     void add();
@@ -181,42 +504,215 @@ public:
 
     uint8_t findSymbol(std::string symbol);
     int findVar(std::string name);
+    int findGlobal(std::string name);
+    int findUpvalue(std::string name);
+    int addUpvalue(bool isLocal, int index);
 
     std::vector<uint8_t> compile(std::vector<Token> in);
 };
 
 struct ObjectClass {
-    std::map<int, std::function<void(VM *vm, Value *args)> > symbols;
+    // Methods by symbol id, nullptr where the class has none.
+    Native methods[256];
+
+    // Symbols whose methods have no side effects.
+    std::bitset<256> pure;
+
+    ObjectClass() :
+        methods()
+    {
+    }
+};
+
+// Symbols of the core library, with ids fixed at compile time. Symbols
+// first seen in scripts are numbered after these.
+enum CoreSymbol {
+    SYMBOL_LT,
+    SYMBOL_GT,
+    SYMBOL_LTEQ,
+    SYMBOL_GTEQ,
+    SYMBOL_EQ,
+    SYMBOL_NEQ,
+    SYMBOL_PLUS,
+    SYMBOL_MINUS,
+    SYMBOL_TIMES,
+    SYMBOL_DIVIDE,
+    SYMBOL_SIN,
+    SYMBOL_SIZE,
+    SYMBOL_ADD,
+    SYMBOL_GET,
+    SYMBOL_SET,
+    SYMBOL_ADD_ALL,
+    SYMBOL_INSERT,
+    SYMBOL_REMOVE,
+    SYMBOL_CLEAR,
+    SYMBOL_SLICE,
+    SYMBOL_RESERVE,
+    SYMBOL_SHRINK,
+    SYMBOL_CAPACITY,
+    SYMBOL_SUM,
+    SYMBOL_MIN,
+    SYMBOL_MAX,
+    SYMBOL_DOT,
+    SYMBOL_SCALE,
+    SYMBOL_FILL,
+    SYMBOL_PARALLEL_MAP,
+    SYMBOL_PARALLEL_REDUCE,
+    SYMBOL_ALIVE,
+    SYMBOL_MAP,
+    SYMBOL_FILTER,
+    SYMBOL_TAKE,
+    SYMBOL_REDUCE,
+    SYMBOL_TO_LIST,
+    SYMBOL_LINES,
+    SYMBOL_CHUNKS,
+    SYMBOL_CONTAINS,
+    SYMBOL_TO_STRING,
+    SYMBOL_KEYS,
+    SYMBOL_VALUES,
+    SYMBOL_PARSE,
+    SYMBOL_STRINGIFY,
+    SYMBOL_SORT,
+    SYMBOL_BINARY_SEARCH,
+    SYMBOL_INDEX_OF,
+    CORE_SYMBOLS
 };
 
+extern const char *const coreSymbolNames[CORE_SYMBOLS];
+
+// The fewest and most arguments each core method takes, in CoreSymbol
+// order; the same for every class that has the method.
+extern const uint8_t coreSymbolArgs[CORE_SYMBOLS][2];
+
 struct CallFrame {
-    CallFrame(uint8_t *ip, std::vector<Value> constants, int memorySize) :
+    CallFrame(uint8_t *ip, Value *constants, Closure *closure, Function *function, int memorySize) :
         ip(ip),
         constants(constants),
+        closure(closure),
+        function(function),
         memorySize(memorySize)
     {
     }
 
     uint8_t *ip;
-    std::vector<Value> constants;
+    Value *constants;
+    Closure *closure;
+    Function *function;
     int memorySize;
 };
 
+// A function running on a call stack of its own. While it is suspended its
+// frames, temporaries and locals wait here; resuming moves them back on top
+// of the VM's, rebased, so a switch costs about as much as a call.
+struct Coroutine : public Object {
+    enum State {
+        NEW,
+        SUSPENDED,
+        RUNNING,
+        DONE,
+    };
+
+    State state;
+    Value callee;
+
+    std::vector<CallFrame> frames;
+    std::vector<Value> stack;
+    std::vector<Value> memory;
+    CallFrame suspended;
+
+    // Captured locals of its frames, closed while it is suspended, with
+    // their slots relative to memoryBase.
+    std::vector<std::pair<Upvalue *, int> > upvalues;
+
+    // Where its part of the VM's frames, stack and memory starts while it
+    // runs, and the coroutine that resumed it.
+    int frameBase;
+    int stackBase;
+    int memoryBase;
+    Coroutine *resumer;
+
+    Coroutine(VM *vm, Value callee);
+};
+
 class VM {
     uint8_t *ip;
     int memoryOffset;
-    std::vector<Value> constants;
+    Value *constants;
+    Closure *closure;
+    Function *function;
+
+    std::vector<Upvalue *> openUpvalues;
+
+    // The coroutine running now, or nullptr outside of any.
+    Coroutine *coroutine;
+
+    // Top-level code from load(), kept while it has not finished.
+    std::vector<uint8_t> program;
+    bool pending;
+
+    // Back-edges and calls left before runFor hands the thread back, and
+    // whether it did; only the outermost execute can stop early.
+    int64_t budget;
+    bool sliced;
+    bool preempted;
+
+    // Calls into scripts that natives are making through call(); a
+    // snapshot can only be taken when there are none.
+    int callbacks;
+
+    // Native calls currently running on the C++ stack.
+    int nativeDepth;
+
+    friend struct Runtime;
+
+    void execute(int exitDepth);
+    bool outOfBudget(int exitDepth);
+    bool enterLoop();
+
+    void indexGet();
+    void indexSet();
+    void buildList(int count);
+    void iterInit(int slot);
+    bool iterNext(int slot);
+    void makeClosure(Function *fn);
+    void resume();
+    void yield(int exitDepth);
+    void unwind(int globals);
 
 public:
     std::vector<Value> memory;
-    
+
+    bool inlining;
+
+    bool jit;
+    int jitThreshold;
+
+    int specialized;
+    int specializable;
+
+    // Threads parallelMap, parallelReduce and sort use; 0 means one per
+    // hardware thread.
+    int workers;
+
+    // Arguments the running native method got, besides the receiver, for
+    // methods whose last arguments are optional.
+    int argCount;
+
     Compiler *compiler;
     ObjectClass *numClass;
     ObjectClass *strClass;
     ObjectClass *listClass;
+    ObjectClass *float64ArrayClass;
     ObjectClass *functionClass;
+    ObjectClass *closureClass;
+    ObjectClass *coroutineClass;
+    ObjectClass *sequenceClass;
+    ObjectClass *fileClass;
+    ObjectClass *stringViewClass;
+    ObjectClass *mapClass;
+    ObjectClass *jsonClass;
 
-    std::map<Function *, std::function<void(VM *vm, Value *args)> > functions;
+    Output output;
 
     std::vector<Value> stack;
     std::vector<CallFrame> frames;
@@ -230,14 +726,106 @@ public:
 
     void printStack();
 
-    void run(std::string code);
+    std::vector<uint8_t> compile(std::string code);
+    // Returns false if the script raised an error, with its message in
+    // error; the VM keeps its globals and can run more code.
+    bool run(std::string code, std::string *error = nullptr);
+
+    enum Status {
+        FINISHED,
+        PREEMPTED,
+        FAILED,
+    };
+
+    // Compiles code for runFor, which then runs it in slices: each call goes
+    // on from where the last stopped, for at most budget back-edges and
+    // calls (0 for no limit) or until the script yields outside any
+    // coroutine. Native code, including JIT-compiled code, is not stopped.
+    // With no budget, as for run() and a ScriptPool, a yield outside any
+    // coroutine is an error instead; only sliced runs (--slice) accept it.
+    bool load(std::string code, std::string *error = nullptr);
+    Status runFor(int64_t budget, std::string *error = nullptr);
+
+    // snapshot(path) in a script: writes the heap, the symbols and where
+    // top-level code has got to into path. Only top-level code can take
+    // one. restore() then stands in for load() in a later process: runFor
+    // carries on just after the call, which returns 1 there instead of 0.
+    void snapshot(const std::string &path);
+    bool restore(const std::string &path, std::string *error = nullptr);
 
     void callMethod(uint8_t code, uint8_t depth);
-    void callFunction(uint8_t depth);
+    Function *callFunction(uint8_t depth);
+    Function *tailCall(uint8_t depth);
+
+    // Calls a script or foreign function from native code.
+    Value call(Value callee, const Value *args, int count);
+
+    Upvalue *captureUpvalue(int slot);
+    void closeUpvalues(int from);
 
     void pushFrame();
     void popFrame();
 };
 
+// Points vm at the shared core classes and fills in the core globals.
 void initCore(VM &vm);
 
+// Core symbol id or global slot for name, or -1.
+int findCoreSymbol(const std::string &name);
+int findCoreGlobal(const std::string &name);
+
+// The initial values of the core globals, by slot.
+const std::vector<Value> &coreGlobalValues();
+
+// list.parallelMap(fn) and list.parallelReduce(fn, init): chunks of the list
+// run on worker threads, each with a VM of its own that sees the caller's
+// variables as they were at the call. fn must not change shared state, and
+// for parallelReduce it must be associative.
+Value parallelMap(VM *vm, List *list, Value fn);
+Value parallelReduce(VM *vm, List *list, Value fn, Value init);
+
+// list.sort() and list.sort(compare): a stable merge sort in place. Lists
+// of numbers or of strings compare natively; compare(a, b) puts a first
+// when it returns a negative number. Large lists are sorted in runs on
+// worker threads, which call compare as parallelMap calls fn.
+void parallelSort(VM *vm, List *list, const Value *compare);
+
+// json.parse and json.stringify. Objects read as Maps and arrays as Lists;
+// true, false and null read as 1, 0 and 0, as scripts have neither
+// booleans nor null.
+Value parseJson(VM *vm, const char *data, int64_t size);
+void writeJson(VM *vm, std::string &out, Value v);
+
+// Checks operand ranges, that jumps land on instruction boundaries and that
+// the stack height agrees across control flow and never underflows. Code
+// starts with arity values on the stack; a function must return exactly
+// one. On failure, error says what is wrong and where.
+bool verifyCode(VM *vm, const std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                int localCount, int upvalueCount, int arity, bool function, std::string *error);
+
+// Verifies fn, aborting if it is invalid, and marks it verified.
+void verifyFunction(VM *vm, Function *fn);
+
+// Script functions reachable from the top-level constants, in a fixed
+// order, so emitted C++ can find the same functions when it loads.
+std::vector<Function *> scriptFunctions(VM *vm);
+
+// Writes a C++ program that runs the compiled script natively.
+void emitCpp(VM *vm, const std::vector<uint8_t> &code, const std::string &source, std::ostream &out);
+
+// Translates fn's bytecode into native code (Linux x86-64 only), filling
+// in fn->native and fn->entries. Returns false if it can't.
+bool jitCompile(VM *vm, Function *fn);
+
+// Rewrites CALLs of +, -, *, /, <, >, <= and >= whose operands are proven
+// numbers into unchecked numeric opcodes. Locals in unknown, and locals
+// never stored to in code, are assumed to hold anything.
+int specializeNumeric(VM *vm, std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                      int localCount, const std::set<int> &unknown, int *candidates);
+
+// Hoists invariant expressions of the while loop at code[start..] into new
+// locals set just before it. Expressions in the condition ahead of any side
+// effect (condition is the pc of its JEQ) may use pure methods; elsewhere
+// only numeric constants are folded out. Returns how many were hoisted.
+int hoistInvariants(VM *vm, std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                    int start, int condition, int &varOffset, const std::set<int> &captured);
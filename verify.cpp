@@ -0,0 +1,224 @@
+#include "value.hpp"
+
+struct Verifier {
+    VM *vm;
+    const std::vector<uint8_t> &code;
+    const std::vector<Value> &constants;
+
+    int localCount;
+    int upvalueCount;
+    bool function;
+
+    std::vector<int> heights;
+    std::vector<int> work;
+    std::string error;
+
+    Verifier(VM *vm, const std::vector<uint8_t> &code, const std::vector<Value> &constants) :
+        vm(vm),
+        code(code),
+        constants(constants)
+    {
+    }
+
+    bool fail(int pc, std::string message) {
+        if (error == "")
+            error = message + " at " + std::to_string(pc) + ".";
+        return false;
+    }
+
+    bool flow(int from, int pc, int height) {
+        if (pc < 0 || pc >= code.size() || heights[pc] == -2)
+            return fail(from, "Jump out of code or into an instruction");
+
+        if (heights[pc] == -1) {
+            heights[pc] = height;
+            work.push_back(pc);
+        } else if (heights[pc] != height) {
+            return fail(pc, "Stack height differs between paths");
+        }
+
+        return true;
+    }
+
+    bool slot(int pc, int index) {
+        return index < localCount || fail(pc, "Memory slot out of range");
+    }
+
+    bool constant(int pc, int index) {
+        return index < constants.size() || fail(pc, "Constant out of range");
+    }
+
+    // Stack effect of an instruction that just falls through.
+    static bool effect(uint8_t op, const uint8_t *operands, int *pops, int *pushes) {
+        *pops = 0;
+        *pushes = 0;
+
+        switch (op) {
+            case MOVB: case MEM: case GLOBAL: case GET_UPVAL: case CLOSURE:
+                *pushes = 1;
+                return true;
+            case JEQ: case ITER_INIT: case MEMSET: case SET_UPVAL: case POP: case DEL: case YIELD:
+                *pops = 1;
+                return true;
+            case RESUME:
+                *pops = 1;
+                *pushes = 1;
+                return true;
+            case INDEX_GET:
+            case ADD: case SUB: case MUL: case DIV: case LT: case GT: case LTEQ: case GTEQ:
+                *pops = 2;
+                *pushes = 1;
+                return true;
+            case INDEX_SET:
+                *pops = 3;
+                return true;
+            case NEW_LIST:
+                *pops = operands[0];
+                *pushes = 1;
+                return true;
+            case CALL:
+                *pops = operands[1] + 1;
+                *pushes = 1;
+                return true;
+            case CALL_FUNC: case TAIL_CALL:
+                *pops = operands[0] + 1;
+                *pushes = 1;
+                return true;
+            case JUMP: case JUMP_BACK: case ITER_NEXT: case RETURN:
+                return true;
+        }
+
+        return false;
+    }
+
+    bool run(int entryHeight) {
+        // -2 marks bytes inside an instruction, -1 starts not yet reached.
+        heights.assign(code.size(), -2);
+
+        for (int pc = 0; pc < code.size(); pc += instructionLength(code[pc])) {
+            if (pc + instructionLength(code[pc]) > code.size())
+                return fail(pc, "Instruction runs past the end of code");
+
+            heights[pc] = -1;
+        }
+
+        if (code.empty())
+            return fail(0, "Empty code");
+
+        flow(0, 0, entryHeight);
+
+        while (!work.empty() && error == "") {
+            int pc = work.back();
+            work.pop_back();
+
+            uint8_t op = code[pc];
+            const uint8_t *operands = code.data() + pc + 1;
+            int height = heights[pc];
+            int next = pc + instructionLength(op);
+
+            int pops, pushes;
+            if (!effect(op, operands, &pops, &pushes))
+                return fail(pc, "Unknown opcode");
+
+            if (pops > height)
+                return fail(pc, "Stack underflow");
+
+            switch (op) {
+                case MOVB:
+                    if (!constant(pc, operands[0]))
+                        return false;
+                    break;
+
+                case CLOSURE:
+                    if (!constant(pc, operands[0]))
+                        return false;
+                    if (!constants[operands[0]].isObject ||
+                        constants[operands[0]].as.object->classObject != vm->functionClass)
+                        return fail(pc, "Closure of something other than a function");
+                    break;
+
+                case MEM:
+                case MEMSET:
+                    if (!slot(pc, operands[0]))
+                        return false;
+                    break;
+
+                case ITER_INIT:
+                case ITER_NEXT:
+                    if (!slot(pc, operands[0] + 1))
+                        return false;
+                    break;
+
+                case GLOBAL:
+                    if (operands[0] >= vm->compiler->varOffset)
+                        return fail(pc, "Global out of range");
+                    break;
+
+                case GET_UPVAL:
+                case SET_UPVAL:
+                    if (operands[0] >= upvalueCount)
+                        return fail(pc, "Upvalue out of range");
+                    break;
+            }
+
+            height += pushes - pops;
+
+            switch (op) {
+                case JUMP:
+                    flow(pc, pc + 1 + operands[0], height);
+                    break;
+
+                case JUMP_BACK:
+                    flow(pc, pc + 1 - operands[0], height);
+                    break;
+
+                case JEQ:
+                    flow(pc, pc + 1 + operands[0], height) && flow(pc, next, height);
+                    break;
+
+                case ITER_NEXT:
+                    flow(pc, pc + 2 + operands[1], height) && flow(pc, next, height + 1);
+                    break;
+
+                case RETURN:
+                    // A function leaves exactly its result; top-level code
+                    // may stop anywhere.
+                    if (function && height != 1)
+                        return fail(pc, "Function returns with stack height " + std::to_string(height));
+                    break;
+
+                default:
+                    if (next >= code.size())
+                        return fail(pc, "Code falls off the end");
+                    flow(pc, next, height);
+                    break;
+            }
+        }
+
+        return error == "";
+    }
+};
+
+bool verifyCode(VM *vm, const std::vector<uint8_t> &code, const std::vector<Value> &constants,
+                int localCount, int upvalueCount, int arity, bool function, std::string *error) {
+    Verifier verifier(vm, code, constants);
+    verifier.localCount = localCount;
+    verifier.upvalueCount = upvalueCount;
+    verifier.function = function;
+
+    if (verifier.run(arity))
+        return true;
+
+    *error = verifier.error;
+    return false;
+}
+
+void verifyFunction(VM *vm, Function *fn) {
+    std::string error;
+
+    if (!verifyCode(vm, fn->code, fn->constants, fn->localCount, fn->upvalues.size(),
+                    fn->arity, true, &error))
+        abort("Invalid bytecode: " + error);
+
+    fn->verified = true;
+}